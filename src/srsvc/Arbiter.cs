@@ -13,6 +13,9 @@ using System.Linq;
 using System.Text;
 using System.IO;
 using System.Text.RegularExpressions;
+using System.Collections.Concurrent;
+using System.Threading.Tasks;
+using NHibernate;
 
 namespace srsvc
 {
@@ -38,6 +41,23 @@ namespace srsvc
             return filePath;
         }
 
+        /// <summary>
+        /// Same as CleanPath, but returns the path as it was if it can't be cleaned up
+        /// </summary>
+        /// <param name="filePath"></param>
+        /// <returns></returns>
+        internal static string TryCleanPath(string filePath)
+        {
+            try
+            {
+                return CleanPath(filePath);
+            }
+            catch (Exception)
+            {
+                return filePath;
+            }
+        }
+
         private static bool ExeMatchesAttribute(RuleAttribute attr, Executable exe)
         {
             Log.Info("Checking with rule: {0},{1}", attr.AttributeType, attr.Attribute);
@@ -80,34 +100,110 @@ namespace srsvc
             return false;
         }
 
-        private static Decision MakeDecisionFromRules(Executable exe)
+        /// <summary>
+        /// Attributes that are about the process being started rather than the file, which are matched against its
+        /// ancestors in the ProcessTree
+        /// </summary>
+        /// <param name="attr"></param>
+        /// <returns></returns>
+        private static bool IsProcessAttribute(RuleAttribute attr)
+        {
+            return attr.AttributeType == "ParentPath" || attr.AttributeType == "AncestorPath";
+        }
+
+        private static bool IsProcessRule(Rule rule)
+        {
+            return rule.Attrs.Any(IsProcessAttribute);
+        }
+
+        private static bool ProcessMatchesAttribute(RuleAttribute attr, ProcessTree.Node process)
+        {
+            Log.Info("Checking with rule: {0},{1}", attr.AttributeType, attr.Attribute);
+            if (attr.AttributeType == "ParentPath")
+            {
+                return process.Parent != null && process.Parent.ImagePath != null && (new Regex(attr.Attribute)).Match(process.Parent.ImagePath).Success;
+            }
+            else if (attr.AttributeType == "AncestorPath")
+            {
+                var regex = new Regex(attr.Attribute);
+                return ProcessTree.GetAncestry(process).Any(ancestor => ancestor.ImagePath != null && regex.Match(ancestor.ImagePath).Success);
+            }
+            return false;
+        }
+
+        /// <summary>
+        /// Enabled rules ordered by rank, with their attributes loaded, so deciding doesn't have to query the DB
+        /// </summary>
+        private static List<Rule> rulesSnapshot = null;
+        private static DateTime rulesLoaded = DateTime.MinValue;
+        private static object rulesLock = new object();
+
+        // Re-read the rules at least this often, in case they were changed outside of AddRuleToDB
+        private static readonly TimeSpan RULES_MAX_AGE = TimeSpan.FromMinutes(1);
+
+        /// <summary>
+        /// Drops the rule snapshot, so the next decision reads the rules again
+        /// </summary>
+        public static void InvalidateRules()
+        {
+            lock (rulesLock)
+            {
+                rulesSnapshot = null;
+            }
+        }
+
+        private static List<Rule> GetRules()
+        {
+            lock (rulesLock)
+            {
+                if (rulesSnapshot == null || DateTime.UtcNow - rulesLoaded > RULES_MAX_AGE)
+                {
+                    var sessionFactory = Database.getSessionFactory();
+                    using (var session = sessionFactory.OpenSession())
+                    {
+                        var rules = session.QueryOver<Rule>()
+                            .Where(e => e.Enabled == true)
+                            .OrderBy(e => e.Rank).Asc
+                            .List<Rule>();
+                        foreach (var rule in rules)
+                        {
+                            // Load the attributes now, while we have a session
+                            NHibernateUtil.Initialize(rule.Attrs);
+                        }
+                        rulesSnapshot = rules.ToList();
+                        rulesLoaded = DateTime.UtcNow;
+                    }
+                }
+                return rulesSnapshot;
+            }
+        }
+
+        private static Decision MakeDecisionFromRules(List<Rule> rules, Executable exe)
         {
             Decision decision = Decision.ALLOW;
 
-            var sessionFactory = Database.getSessionFactory();
-            using (var session = sessionFactory.OpenSession())
+            foreach (var rule in rules)
             {
-                var rules = session.QueryOver<Rule>()
-                    .Where(e => e.Enabled == true)
-                    .OrderBy(e => e.Rank).Asc
-                    .List<Rule>();
-                foreach (var rule in rules)
-                {
-                    bool match = true;
-                    foreach (var attr in rule.Attrs)
+                if (IsProcessRule(rule))
+                {
+                    // See MakeDecisionFromProcessRules
+                    continue;
+                }
+
+                bool match = true;
+                foreach (var attr in rule.Attrs)
+                {
+                    match = match & ExeMatchesAttribute(attr, exe);
+                }
+                if (match)
+                {
+                    if (rule.Allow)
                     {
-                        match = match & ExeMatchesAttribute(attr, exe);
+                        decision = Decision.ALLOW;
                     }
-                    if (match)
+                    else
                     {
-                        if (rule.Allow)
-                        {
-                            decision = Decision.ALLOW;
-                        }
-                        else
-                        {
-                            decision = Decision.DENY;
-                        }
+                        decision = Decision.DENY;
                     }
                 }
             }
@@ -115,6 +211,89 @@ namespace srsvc
             return decision;
         }
 
+        /// <summary>
+        /// Tries to decide from the path alone, before the file has been hashed or verified.  The highest ranked rule that
+        /// matches wins, so working down from the top, the first path-only rule that matches decides.  If we get to a rule
+        /// that needs hashes or signers first, we can't know yet and return null.
+        /// </summary>
+        /// <param name="rules"></param>
+        /// <param name="filePath"></param>
+        /// <returns></returns>
+        private static Decision? MakeDecisionFromPathRules(List<Rule> rules, string filePath)
+        {
+            var exe = new Executable { Path = filePath };
+
+            for (int i = rules.Count - 1; i >= 0; i--)
+            {
+                var rule = rules[i];
+                if (IsProcessRule(rule))
+                {
+                    continue;
+                }
+                if (rule.Attrs.Any(attr => attr.AttributeType != "path"))
+                {
+                    return null;
+                }
+
+                bool match = true;
+                foreach (var attr in rule.Attrs)
+                {
+                    match = match & ExeMatchesAttribute(attr, exe);
+                }
+                if (match)
+                {
+                    return rule.Allow ? Decision.ALLOW : Decision.DENY;
+                }
+            }
+
+            // Nothing can match, which is the same as no rules matching
+            return Decision.ALLOW;
+        }
+
+        /// <summary>
+        /// Decides from the rules about the process's ancestors (ParentPath, AncestorPath), which can be combined with
+        /// path attributes.  These are checked separately from the rules on the file, and the highest ranked one that
+        /// matches decides over them, since the same file can be fine to run from one parent and not from another.
+        /// Returns null if none match.
+        /// </summary>
+        /// <param name="rules"></param>
+        /// <param name="filePath"></param>
+        /// <param name="process"></param>
+        /// <returns></returns>
+        private static Decision? MakeDecisionFromProcessRules(List<Rule> rules, string filePath, ProcessTree.Node process)
+        {
+            var exe = new Executable { Path = filePath };
+
+            for (int i = rules.Count - 1; i >= 0; i--)
+            {
+                var rule = rules[i];
+                if (!IsProcessRule(rule))
+                {
+                    continue;
+                }
+
+                bool match = true;
+                foreach (var attr in rule.Attrs)
+                {
+                    if (IsProcessAttribute(attr))
+                    {
+                        match = match & ProcessMatchesAttribute(attr, process);
+                    }
+                    else
+                    {
+                        // Only the path is known this early, so process rules with hashes or signers never match
+                        match = match && attr.AttributeType == "path" && ExeMatchesAttribute(attr, exe);
+                    }
+                }
+                if (match)
+                {
+                    return rule.Allow ? Decision.ALLOW : Decision.DENY;
+                }
+            }
+
+            return null;
+        }
+
         private static Decision FinalDecisionBasedOnMode(Decision decision)
         {
             // TODO MUST set audit mode to false so we can be locked down
@@ -130,61 +309,326 @@ namespace srsvc
         }
 
         /// <summary>
-        /// This function is called when a new process is being started.  It return the decision if the process should be allowed to run.
-        /// It stores some data in the DB about this executable (such as the computed hashes).
+        /// We have to answer the driver within this long, as it lets the process run if we haven't answered in 3 seconds (QD_TIMEOUT)
+        /// </summary>
+        public static readonly TimeSpan DECISION_BUDGET = TimeSpan.FromMilliseconds(2500);
+
+        /// <summary>
+        /// Executables already in the DB, by path and last write time, so repeat launches don't need a query
+        /// </summary>
+        private class KnownExecutable
+        {
+            public long Id;
+            public bool Trusted;
+        }
+        private static ConcurrentDictionary<string, KnownExecutable> knownExecutables = new ConcurrentDictionary<string, KnownExecutable>();
+        private const int MAX_KNOWN_EXECUTABLES = 100000;
+
+        /// <summary>
+        /// IDs of certificates already in the DB, by issuer and serial number.  Few publishers sign most files, so this
+        /// stays small and saves a query for each signer of each new executable.
+        /// </summary>
+        private static ConcurrentDictionary<string, long> knownCertificates = new ConcurrentDictionary<string, long>();
+        private const int MAX_KNOWN_CERTIFICATES = 10000;
+
+        // SQLite only allows one writer, so save executables one at a time
+        private static object persistLock = new object();
+
+        /// <summary>
+        /// A decision on a new executable that's being worked on.  Launches of the same file while it's in here wait for
+        /// its result instead of hashing and verifying the file again (ex. a build starting hundreds of cl.exe at once).
+        /// </summary>
+        private class InFlightDecision
+        {
+            public TaskCompletionSource<Decision> Decided = new TaskCompletionSource<Decision>();
+            public TaskCompletionSource<long> Recorded = new TaskCompletionSource<long>();
+        }
+        private static ConcurrentDictionary<string, InFlightDecision> inFlightDecisions = new ConcurrentDictionary<string, InFlightDecision>();
+
+        private static string KnownKey(string filePath, DateTime lastWriteTime)
+        {
+            return filePath.ToLowerInvariant() + "|" + lastWriteTime.Ticks;
+        }
+
+        /// <summary>
+        /// This function is called when a new process is being started.  It returns the decision if the process should be allowed to run,
+        /// within the given budget.
+        ///
+        /// The decision is made in stages (identity, cache, policy on the path, hash, signature, rules), and we answer as soon as one
+        /// of them is decisive.  Saving the executable to the DB happens after that, and onRecorded is then called with its ID
+        /// and the decision.
+        /// If the stages haven't finished in time, we answer with a provisional decision and let them carry on in the background,
+        /// killing the process if they deny it.
+        /// </summary>
+        /// <param name="filePath"></param>
+        /// <param name="process">The process being started, from the ProcessTree, or null if not known</param>
+        /// <param name="budget">How long we have to answer</param>
+        /// <param name="onRecorded">Called with the executable's DB ID and the final decision once the executable has been recorded, off the caller's thread</param>
+        /// <returns>Decision on if the process should be allowed to run</returns>
+        public static Decision DecideOnProcess(string filePath, ProcessTree.Node process, TimeSpan budget, Action<long, Decision> onRecorded)
+        {
+            var decided = new TaskCompletionSource<Decision>();
+            Task.Factory.StartNew(() => RunStages(filePath, process, decided, onRecorded, false));
+
+            if (decided.Task.Wait(budget))
+            {
+                DecisionMetrics.RecordDecision(false);
+                return decided.Task.Result;
+            }
+
+            // Too slow, so allow it for now.  If it turns out it should be denied, it's killed when the stages finish, and
+            // onRecorded logs it as denied.
+            Log.Warn("No decision on {0} within {1}ms, allowing it provisionally", filePath, budget.TotalMilliseconds);
+            DecisionMetrics.RecordDecision(true);
+            decided.Task.ContinueWith(t =>
+            {
+                if (t.Result == Decision.DENY)
+                {
+                    KillProvisionallyAllowed(filePath, process);
+                }
+            });
+            return FinalDecisionBasedOnMode(Decision.ALLOW);
+        }
+
+        /// <summary>
+        /// A process that was started later than this after we were told about it has reused the pid
+        /// </summary>
+        private static readonly TimeSpan PID_REUSE_TOLERANCE = TimeSpan.FromSeconds(2);
+
+        /// <summary>
+        /// Kills a process that was allowed to start before we'd decided on it, and has since been denied
+        /// </summary>
+        /// <param name="filePath"></param>
+        /// <param name="process"></param>
+        private static void KillProvisionallyAllowed(string filePath, ProcessTree.Node process)
+        {
+            if (FinalDecisionBasedOnMode(Decision.DENY) != Decision.DENY)
+            {
+                Log.Warn("*** Provisionally allowed process should have been denied, not killed in audit mode: {0}", filePath);
+                return;
+            }
+            if (process == null)
+            {
+                Log.Warn("*** Provisionally allowed process should have been denied, but we don't know its pid: {0}", filePath);
+                return;
+            }
+
+            try
+            {
+                using (var running = System.Diagnostics.Process.GetProcessById((int)process.Pid))
+                {
+                    if (running.StartTime.ToUniversalTime() > process.StartTime + PID_REUSE_TOLERANCE)
+                    {
+                        Log.Info("Denied process {0} ({1}) has already exited", process.Pid, filePath);
+                        return;
+                    }
+
+                    running.Kill();
+                    Log.Warn("*** Killed provisionally allowed process {0} that has been denied: {1}", process.Pid, filePath);
+                }
+            }
+            catch (ArgumentException)
+            {
+                // No process with this pid
+                Log.Info("Denied process {0} ({1}) has already exited", process.Pid, filePath);
+            }
+            catch (Exception e)
+            {
+                Log.Exception(e, "Unable to kill denied process {0} ({1})", process.Pid, filePath);
+            }
+        }
+
+        /// <summary>
+        /// Same as above, but waits for everything to finish, including recording the executable to the DB
         /// </summary>
         /// <param name="filePath"></param>
+        /// <param name="process">The process, from the ProcessTree, or null if not known</param>
         /// <param name="ExecutableId">Database ID for the executable</param>
         /// <returns>Decision on if the process should be allowed to run</returns>
-        public static Decision DecideOnProcess(string filePath, out long ExecutableId)
+        public static Decision DecideOnProcess(string filePath, ProcessTree.Node process, out long ExecutableId)
+        {
+            var decided = new TaskCompletionSource<Decision>();
+            var recorded = new TaskCompletionSource<long>();
+            RunStages(filePath, process, decided, (recordedId, recordedDecision) => recorded.TrySetResult(recordedId), false);
+
+            ExecutableId = recorded.Task.Result;
+            return decided.Task.Result;
+        }
+
+        /// <summary>
+        /// Decides on a file that hasn't been run yet (see PreScanner), so its first launch can be answered from the cache.
+        /// This runs on the pre-scan thread in background mode, so it's left out of the launch latency metrics, launches
+        /// don't wait on it, and it leaves background mode while it holds the lock on saving executables.
+        /// </summary>
+        /// <param name="filePath"></param>
+        /// <returns>True if the file was read, false if it was already known</returns>
+        public static bool PreAnalyze(string filePath)
         {
+            return RunStages(filePath, null, new TaskCompletionSource<Decision>(), null, true);
+        }
+
+        /// <summary>
+        /// Runs the decision stages.  The decision is handed back through "decided" as soon as it's known, and the
+        /// remaining work carries on.  This never throws, and always sets a decision and calls onRecorded.
+        /// </summary>
+        /// <param name="filePath"></param>
+        /// <param name="process"></param>
+        /// <param name="decided"></param>
+        /// <param name="onRecorded"></param>
+        /// <param name="preScan">True when called from PreAnalyze</param>
+        /// <returns>True if the file was hashed</returns>
+        private static bool RunStages(string filePath, ProcessTree.Node process, TaskCompletionSource<Decision> decided, Action<long, Decision> onRecorded, bool preScan)
+        {
+            bool recordMetrics = !preScan;
+            bool hashedFile = false;
             Log.Info("Arbiter deciding on process");
             Decision decision = Decision.ALLOW;
             List<Signer> signers = null;
-            ExecutableId = 0;  // TODO Must do something where there is an error in this function so we don't record that something with ExecutableID 0 happened
+            long ExecutableId = 0;  // TODO Must do something where there is an error in this function so we don't record that something with ExecutableID 0 happened
+            string inFlightKey = null;
+            InFlightDecision flight = null;
+            // "decided" becomes the shared decision if we lead a flight, but this launch's own decision is what gets recorded
+            var ownDecided = decided;
 
             try
             {
-                filePath = CleanPath(filePath);
-                Log.Info("Deciding on process: {0}", filePath);
+                //
+                // Identity: which file is this
+                //
+                DateTime lastWriteTime;
+                using (DecisionMetrics.Time(DecisionStage.Identity, recordMetrics))
+                {
+                    filePath = CleanPath(filePath);
+                    Log.Info("Deciding on process: {0}", filePath);
+
+                    lastWriteTime = File.GetLastWriteTime(filePath);
+                    lastWriteTime = lastWriteTime.ToUniversalTime();
+                }
 
                 //
-                // Check if we've seen this before
+                // Process: rules on the process's ancestors decide over the rules on the file.  They differ between launches
+                // of the same file, so they're checked before the cached and shared decisions, which are only about the file.
                 //
-                DateTime lastWriteTime = File.GetLastWriteTime(filePath);
-                lastWriteTime = lastWriteTime.ToUniversalTime();
+                if (process != null)
+                {
+                    Decision? processDecision = MakeDecisionFromProcessRules(GetRules(), filePath, process);
+                    if (processDecision.HasValue)
+                    {
+                        Log.Info("Decided on {0} from its parent processes", process);
+                        decided.TrySetResult(FinalDecisionBasedOnMode(processDecision.Value));
+                    }
+                }
 
-                var sessionFactory = Database.getSessionFactory();
-                using (var session = sessionFactory.OpenSession())
+                //
+                // Cache: check if we've seen this before
+                //
+                KnownExecutable known;
+                using (DecisionMetrics.Time(DecisionStage.Cache, recordMetrics))
                 {
-                    var exes = session.QueryOver<Executable>()
-                        .Where(e => e.Path == filePath)
-                        .And(e =>e.LastWriteTime == lastWriteTime)
-                        .List<Executable>();
-                    if (exes.Count() != 0)
+                    known = FindKnownExecutable(filePath, lastWriteTime);
+                }
+                if (known != null)
+                {
+                    Log.Debug("Exe has been seen before");
+                    ExecutableId = known.Id;
+                    // TODO need to use a rule engine
+                    if (!known.Trusted)
                     {
-                        Executable foundExe = exes[0];
-                        Log.Debug("Exe has been seen before");
-                        ExecutableId = foundExe.Id;
-                        // TODO need to use a rule engine
-                        if (!foundExe.Trusted)
-                        {
-                            Log.Info("Deny it");
-                            decision = Decision.DENY;
-                        }
-                        else
+                        Log.Info("Deny it");
+                        decision = Decision.DENY;
+                    }
+                    else
+                    {
+                        Log.Info("Allow it");
+                    }
+                    decided.TrySetResult(decision);
+                    return hashedFile;
+                }
+
+                //
+                // Only one decision per file at a time.  If another launch of this file got here first, share its result.
+                // Pre-scans stay out of this, as a launch waiting on one would be held up by its background priority.
+                //
+                inFlightKey = KnownKey(filePath, lastWriteTime);
+                if (preScan)
+                {
+                    if (inFlightDecisions.ContainsKey(inFlightKey))
+                    {
+                        // A launch is already deciding on it, so there's nothing for us to do
+                        decided.TrySetResult(decision);
+                        return hashedFile;
+                    }
+                }
+                else
+                {
+                    var ours = new InFlightDecision();
+                    flight = inFlightDecisions.GetOrAdd(inFlightKey, ours);
+                    if (flight != ours)
+                    {
+                        Log.Debug("Already deciding on this exe, waiting for that decision");
+                        var callerDecided = decided;
+                        var callerRecorded = onRecorded;
+                        flight.Decided.Task.ContinueWith(t => callerDecided.TrySetResult(t.Result), TaskContinuationOptions.ExecuteSynchronously);
+                        if (callerRecorded != null)
                         {
-                            Log.Info("Allow it");
+                            flight.Recorded.Task.ContinueWith(t =>
+                            {
+                                try
+                                {
+                                    // The shared decision is always set before the executable is recorded
+                                    callerRecorded(t.Result, callerDecided.Task.Result);
+                                }
+                                catch (Exception e)
+                                {
+                                    Log.Exception(e, "Exception recording process");
+                                }
+                            });
                         }
-                        return decision;
+
+                        // The other decision will do the recording
+                        flight = null;
+                        onRecorded = null;
+                        return hashedFile;
                     }
+
+                    // Our decision goes to everyone waiting on this file
+                    flight.Decided.Task.ContinueWith(t => ownDecided.TrySetResult(t.Result), TaskContinuationOptions.ExecuteSynchronously);
+                    decided = flight.Decided;
                 }
 
+                //
+                // Policy: rules that only look at the path can answer before we've read the file
+                //
+                List<Rule> rules;
+                using (DecisionMetrics.Time(DecisionStage.Policy, recordMetrics))
+                {
+                    rules = GetRules();
+                    Decision? pathDecision = MakeDecisionFromPathRules(rules, filePath);
+                    if (pathDecision.HasValue)
+                    {
+                        decided.TrySetResult(FinalDecisionBasedOnMode(pathDecision.Value));
+                    }
+                }
 
                 //
-                // If we're here then this is new, so verify it
+                // Hash: this is the only time we read the whole file, as the catalog lookups in the verification below
+                // use the image hashes computed here.
                 //
-                bool isVerified = WinTrustVerify.WinTrust.Verify(filePath, out signers);
+                FileHashes hashes;
+                using (DecisionMetrics.Time(DecisionStage.Hash, recordMetrics))
+                {
+                    hashedFile = true;
+                    hashes = Helpers.ComputeFileHashes(filePath);
+                }
+
+                //
+                // Signature: verify it
+                //
+                bool isVerified;
+                using (DecisionMetrics.Time(DecisionStage.Signature, recordMetrics))
+                {
+                    isVerified = WinTrustVerify.WinTrust.Verify(filePath, hashes, out signers);
+                }
                 string SignerName = "";
                 if (isVerified)
                 {
@@ -199,10 +643,6 @@ namespace srsvc
                     Log.Info("File is not signed (or not trusted)");
                 }
 
-                // Compute hashes
-                byte[] md5Hash, sha1Hash, sha256Hash;
-                Helpers.ComputeHashes(filePath, out md5Hash, out sha1Hash, out sha256Hash);
-
 
                 // Gather all this data
                 var exe = new Executable
@@ -214,65 +654,187 @@ namespace srsvc
                     LastChecked = DateTime.UtcNow,
                     Signed = (signers != null),
                     Blocked = false, // TODO Change this based on if we are in audit mode
-                    Md5 = md5Hash,
-                    Sha1 = sha1Hash,
-                    Sha256 = sha256Hash,
+                    Md5 = hashes.Md5,
+                    Sha1 = hashes.Sha1,
+                    Sha256 = hashes.Sha256,
+                    Size = hashes.Size,
                 };
+                if (signers != null)
+                {
+                    Database.AddSignersToExe(exe, signers);
+                }
 
+                //
+                // Rules: make a decision on it
+                //
+                using (DecisionMetrics.Time(DecisionStage.Rules, recordMetrics))
+                {
+                    decision = MakeDecisionFromRules(rules, exe);
+                    exe.Trusted = (decision == Decision.ALLOW);
+                }
+                decided.TrySetResult(FinalDecisionBasedOnMode(decision));
 
                 //
-                // Record this info to the DB
+                // Persist: record this info to the DB, now that the caller has its answer
                 //
+                using (DecisionMetrics.Time(DecisionStage.Persist, recordMetrics))
+                {
+                    // Launches wait on persistLock, so don't hold it at background priority
+                    if (preScan)
+                    {
+                        PreScanner.EndBackgroundMode();
+                    }
+                    try
+                    {
+                        ExecutableId = SaveExecutable(exe, signers);
+                    }
+                    finally
+                    {
+                        if (preScan)
+                        {
+                            PreScanner.BeginBackgroundMode();
+                        }
+                    }
+                }
+            }
+            catch (Exception e)
+            {
+                Log.Exception(e, "Exception in DecideOnProcess");
+                decided.TrySetResult(FinalDecisionBasedOnMode(decision));
+            }
+            finally
+            {
+                if (flight != null)
+                {
+                    // The executable is in knownExecutables by now, so later launches won't need to wait on anyone
+                    decided.TrySetResult(FinalDecisionBasedOnMode(decision));
+                    InFlightDecision removed;
+                    inFlightDecisions.TryRemove(inFlightKey, out removed);
+                    flight.Recorded.TrySetResult(ExecutableId);
+                }
+
+                if (onRecorded != null)
+                {
+                    try
+                    {
+                        decided.TrySetResult(FinalDecisionBasedOnMode(decision));
+                        // A process rule may have decided this launch differently from the file's shared decision
+                        ownDecided.TrySetResult(decided.Task.Result);
+                        onRecorded(ExecutableId, ownDecided.Task.Result);
+                    }
+                    catch (Exception e)
+                    {
+                        Log.Exception(e, "Exception recording process");
+                    }
+                }
+            }
+            return hashedFile;
+        }
+
+        /// <summary>
+        /// Looks for this executable in memory and then in the DB.  Returns null if it's new.
+        /// </summary>
+        /// <param name="filePath"></param>
+        /// <param name="lastWriteTime"></param>
+        /// <returns></returns>
+        private static KnownExecutable FindKnownExecutable(string filePath, DateTime lastWriteTime)
+        {
+            KnownExecutable known;
+            string key = KnownKey(filePath, lastWriteTime);
+            if (knownExecutables.TryGetValue(key, out known))
+            {
+                return known;
+            }
+
+            var sessionFactory = Database.getSessionFactory();
+            using (var session = sessionFactory.OpenSession())
+            {
+                var exes = session.QueryOver<Executable>()
+                    .Where(e => e.Path == filePath)
+                    .And(e => e.LastWriteTime == lastWriteTime)
+                    .List<Executable>();
+                if (exes.Count() == 0)
+                {
+                    return null;
+                }
+                known = RememberExecutable(exes[0]);
+            }
+            return known;
+        }
+
+        private static KnownExecutable RememberExecutable(Executable exe)
+        {
+            if (knownExecutables.Count >= MAX_KNOWN_EXECUTABLES)
+            {
+                knownExecutables.Clear();
+            }
+            var known = new KnownExecutable { Id = exe.Id, Trusted = exe.Trusted };
+            knownExecutables[KnownKey(exe.Path, exe.LastWriteTime)] = known;
+            return known;
+        }
+
+        /// <summary>
+        /// Saves a newly seen executable, returning its ID
+        /// </summary>
+        /// <param name="exe"></param>
+        /// <param name="signers"></param>
+        /// <returns></returns>
+        private static long SaveExecutable(Executable exe, List<Signer> signers)
+        {
+            lock (persistLock)
+            {
+                var sessionFactory = Database.getSessionFactory();
                 using (var session = sessionFactory.OpenSession())
                 {
                     using (var transaction = session.BeginTransaction())
                     {
                         // I don't really need to check again, but I'm worried about a race
                         var exes = session.QueryOver<Executable>()
-                                .Where(e => e.Path == filePath)
-                                .And(e => e.LastWriteTime == lastWriteTime)
+                                .Where(e => e.Path == exe.Path)
+                                .And(e => e.LastWriteTime == exe.LastWriteTime)
                                 .List<Executable>();
-                        if (exes.Count() == 0)
+                        if (exes.Count() != 0)
+                        {
+                            return RememberExecutable(exes[0]).Id;
+                        }
+
+                        // Ensure we don't add certs to the DB if they already exist there
+                        if (signers != null)
                         {
-                            // Ensure we don't add certs to the DB if they already exist there
-                            if (signers != null)
+                            foreach (var signer in signers)
                             {
-                                foreach (var signer in signers)
+                                string certKey = signer.SigningCert.Issuer + "|" + Helpers.ByteArrayToHexString(signer.SigningCert.SerialNumber);
+                                long certId;
+                                if (knownCertificates.TryGetValue(certKey, out certId))
+                                {
+                                    signer.SigningCert = session.Load<Certificate>(certId);
+                                    break;
+                                }
+
+                                var certs = session.QueryOver<Certificate>()
+                                    .Where(e => e.SerialNumber == signer.SigningCert.SerialNumber)
+                                    .And(e => e.Issuer == signer.SigningCert.Issuer)
+                                    .List<Certificate>();
+                                if (certs.Count() != 0)
                                 {
-                                    var certs = session.QueryOver<Certificate>()
-                                        .Where(e => e.SerialNumber == signer.SigningCert.SerialNumber)
-                                        .And(e => e.Issuer == signer.SigningCert.Issuer)
-                                        .List<Certificate>();
-                                    if (certs.Count() != 0)
+                                    if (knownCertificates.Count >= MAX_KNOWN_CERTIFICATES)
                                     {
-                                        signer.SigningCert = certs[0];
-                                        break;
+                                        knownCertificates.Clear();
                                     }
+                                    knownCertificates[certKey] = certs[0].Id;
+                                    signer.SigningCert = certs[0];
+                                    break;
                                 }
-
-                                Database.AddSignersToExe(exe, signers);
                             }
+                        }
 
-                            //
-                            // Make a decision on it 
-                            //
-                            decision = MakeDecisionFromRules(exe);
-                            exe.Trusted = (decision == Decision.ALLOW);
-
-                            session.Save(exe);
-                            transaction.Commit();
+                        session.Save(exe);
+                        transaction.Commit();
 
-                            ExecutableId = exe.Id;
-                        }
+                        return RememberExecutable(exe).Id;
                     }
                 }
             }
-            catch (Exception e)
-            {
-                Log.Exception(e, "Exception in DecideOnProcess");
-            }
-
-            return FinalDecisionBasedOnMode(decision);
         }
     }
 }
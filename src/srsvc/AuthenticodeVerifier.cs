@@ -0,0 +1,476 @@
+﻿////////////////////////////////////////////////////////////////////////////
+//
+// Summit Route End Point Protection
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+using System.IO;
+using System.Security.Cryptography;
+using System.Security.Cryptography.Pkcs;
+using System.Security.Cryptography.X509Certificates;
+
+using WinVerifyTrustResult = srsvc.WinTrustVerify.WinVerifyTrustResult;
+
+namespace srsvc
+{
+    /// <summary>
+    /// Verifies embedded Authenticode signatures in PE files without WinVerifyTrust.
+    ///
+    /// The signature is read from the file's certificate table and decoded as PKCS#7 SignedData.  The digest it signs is
+    /// compared with the image hash we computed while hashing the file (see ImageHashAlgorithm), and the signer's chain is
+    /// built with X509Chain for code signing.  Nothing here keeps per-call state, so many files can be verified at once.
+    ///
+    /// For anything it doesn't handle (unknown digest algorithms, RFC 3161 timestamps on expired certs, unparsable
+    /// signatures) it returns null and the caller falls back to WinVerifyTrust.
+    /// </summary>
+    public static class AuthenticodeVerifier
+    {
+        private const ushort WIN_CERT_TYPE_PKCS_SIGNED_DATA = 0x0002;
+        private const int WIN_CERTIFICATE_HEADER_SIZE = 8;
+
+        // Signatures bigger than this are not something we want to be decoding
+        private const long MAX_CERT_TABLE_SIZE = 16 * 1024 * 1024;
+
+        private const string SPC_INDIRECT_DATA_OBJID = "1.3.6.1.4.1.311.2.1.4";
+        private const string szOID_OIWSEC_sha1 = "1.3.14.3.2.26";
+        private const string szOID_NIST_sha256 = "2.16.840.1.101.3.4.2.1";
+        private const string szOID_PKIX_KP_CODE_SIGNING = "1.3.6.1.5.5.7.3.3";
+        private const string szOID_PKIX_KP_TIMESTAMP_SIGNING = "1.3.6.1.5.5.7.3.8";
+        private const string szOID_RSA_signingTime = "1.2.840.113549.1.9.5";
+
+        /// <summary>
+        /// Chain problems WinVerifyTrust doesn't fail on with the settings we give it (no extra revocation checks)
+        /// </summary>
+        private const X509ChainStatusFlags IGNORED_CHAIN_STATUS =
+            X509ChainStatusFlags.RevocationStatusUnknown |
+            X509ChainStatusFlags.OfflineRevocation;
+
+        /// <summary>
+        /// Verifies the embedded signature of a PE file.
+        /// </summary>
+        /// <param name="FileName"></param>
+        /// <param name="Hashes">Hashes of the file, which must include the image hashes</param>
+        /// <param name="Signers"></param>
+        /// <returns>The same result WinVerifyTrust would give, or null if WinVerifyTrust needs to be asked</returns>
+        public static WinVerifyTrustResult? Verify(string FileName, FileHashes Hashes, out List<Signer> Signers)
+        {
+            Signers = null;
+
+            if (Hashes == null || Hashes.Layout == null)
+            {
+                // Not a PE file, or one we couldn't parse
+                return null;
+            }
+            if (Hashes.Layout.CertTableSize == 0)
+            {
+                return WinVerifyTrustResult.FileNotSigned;
+            }
+
+            SignedCms cms;
+            string digestOid;
+            byte[] digest;
+            try
+            {
+                byte[] signedData = ReadSignedData(FileName, Hashes.Layout);
+                if (signedData == null)
+                {
+                    return null;
+                }
+
+                cms = new SignedCms();
+                cms.Decode(signedData);
+                if (cms.ContentInfo.ContentType.Value != SPC_INDIRECT_DATA_OBJID || cms.SignerInfos.Count == 0)
+                {
+                    return null;
+                }
+
+                ReadIndirectDataDigest(cms.ContentInfo.Content, out digestOid, out digest);
+            }
+            catch (Exception e)
+            {
+                if (!(e is CryptographicException || e is InvalidDataException || e is IOException))
+                {
+                    throw;
+                }
+                Log.Debug("Unable to decode signature of {0}, leaving it to WinVerifyTrust: {1}", FileName, e.Message);
+                return null;
+            }
+
+            //
+            // Check the file is what was signed
+            //
+            byte[] imageHash;
+            if (digestOid == szOID_OIWSEC_sha1)
+            {
+                imageHash = Hashes.ImageSha1;
+            }
+            else if (digestOid == szOID_NIST_sha256)
+            {
+                imageHash = Hashes.ImageSha256;
+            }
+            else
+            {
+                return null;
+            }
+
+            if (!Helpers.ByteArrayAreEqual(imageHash, digest))
+            {
+                Log.Warn("Image hash of {0} does not match its signature", FileName);
+                return WinVerifyTrustResult.SignatureOrFileCorrupt;
+            }
+
+            //
+            // Check the signature over the digest
+            //
+            SignerInfo signerInfo = cms.SignerInfos[0];
+            X509Certificate2 cert = signerInfo.Certificate;
+            if (cert == null)
+            {
+                return null;
+            }
+            try
+            {
+                signerInfo.CheckSignature(true);
+            }
+            catch (CryptographicException e)
+            {
+                Log.Warn("Signature of {0} is not valid: {1}", FileName, e.Message);
+                return WinVerifyTrustResult.SignatureOrFileCorrupt;
+            }
+
+            DateTime? signingTime = GetCounterSignatureTime(signerInfo, cms.Certificates);
+            DateTime timestamp = signingTime ?? DateTime.Now;
+
+            //
+            // Check the chain, unless we already have for this cert as of the same kind of time
+            //
+            string cacheKey = GetChainCacheKey(cert, signingTime);
+            SignerCache.Entry cached;
+            if (SignerCache.TryGet(cacheKey, out cached))
+            {
+                if (cached.Result != WinVerifyTrustResult.Success)
+                {
+                    return cached.Result;
+                }
+                Signers = new List<Signer>();
+                Signers.Add(cached.CreateSigner(timestamp));
+                return WinVerifyTrustResult.Success;
+            }
+
+            WinVerifyTrustResult? result = VerifyChain(cert, cms.Certificates, signingTime);
+            if (result == null)
+            {
+                return null;
+            }
+            if (result != WinVerifyTrustResult.Success)
+            {
+                Log.Warn("Verification of {0} failed due to reason {1}", FileName, result);
+                SignerCache.AddUntrusted(cacheKey, result.Value, cert.NotAfter);
+                return result;
+            }
+
+            var signer = CreateSigner(cert, timestamp);
+
+            // A chain checked as of a signing time stays valid after the cert expires
+            SignerCache.AddTrusted(cacheKey, signer, (signingTime != null) ? DateTime.MaxValue : cert.NotAfter);
+
+            Signers = new List<Signer>();
+            Signers.Add(signer);
+            return WinVerifyTrustResult.Success;
+        }
+
+        /// <summary>
+        /// Key for the SignerCache entry with the chain's verdict, which depends on the time the chain is checked as of.
+        /// Chains checked as of now are kept apart from those checked as of a timestamp in the cert's validity period.
+        /// Returns null, so nothing is cached, for a timestamp outside it.
+        /// </summary>
+        /// <param name="cert"></param>
+        /// <param name="signingTime"></param>
+        /// <returns></returns>
+        private static string GetChainCacheKey(X509Certificate2 cert, DateTime? signingTime)
+        {
+            string key = SignerCache.CertificateKey(cert);
+            if (signingTime == null)
+            {
+                return key + "|now";
+            }
+            if (signingTime.Value >= cert.NotBefore && signingTime.Value <= cert.NotAfter)
+            {
+                return key + "|timestamped";
+            }
+            return null;
+        }
+
+        /// <summary>
+        /// Returns the PKCS#7 SignedData from the file's certificate table, or null if there isn't one
+        /// </summary>
+        /// <param name="FileName"></param>
+        /// <param name="Layout"></param>
+        /// <returns></returns>
+        private static byte[] ReadSignedData(string FileName, PeImageLayout Layout)
+        {
+            if (Layout.CertTableSize > MAX_CERT_TABLE_SIZE)
+            {
+                return null;
+            }
+
+            using (var input = new FileStream(FileName, FileMode.Open, FileAccess.Read, FileShare.Read))
+            {
+                var reader = new BinaryReader(input);
+                long position = Layout.CertTableOffset;
+                long end = Layout.CertTableOffset + Layout.CertTableSize;
+
+                // The table is a list of WIN_CERTIFICATE structures, each 8 byte aligned
+                while (position + WIN_CERTIFICATE_HEADER_SIZE <= end)
+                {
+                    input.Seek(position, SeekOrigin.Begin);
+                    uint dwLength = reader.ReadUInt32();
+                    reader.ReadUInt16();  // wRevision
+                    ushort wCertificateType = reader.ReadUInt16();
+
+                    if (dwLength < WIN_CERTIFICATE_HEADER_SIZE || position + dwLength > end)
+                    {
+                        throw new InvalidDataException("Bad WIN_CERTIFICATE length");
+                    }
+
+                    if (wCertificateType == WIN_CERT_TYPE_PKCS_SIGNED_DATA)
+                    {
+                        return reader.ReadBytes((int)dwLength - WIN_CERTIFICATE_HEADER_SIZE);
+                    }
+
+                    position += (dwLength + 7) & ~7L;
+                }
+            }
+            return null;
+        }
+
+        /// <summary>
+        /// Gets the digest out of the SpcIndirectDataContent that Authenticode signs
+        /// </summary>
+        /// <param name="content"></param>
+        /// <param name="digestOid"></param>
+        /// <param name="digest"></param>
+        private static void ReadIndirectDataDigest(byte[] content, out string digestOid, out byte[] digest)
+        {
+            var reader = new DerReader(content);
+            if (reader.PeekTag() == DerReader.TAG_OCTET_STRING)
+            {
+                reader = new DerReader(reader.ReadBytes(DerReader.TAG_OCTET_STRING));
+            }
+
+            // SpcIndirectDataContent ::= SEQUENCE { data SpcAttributeTypeAndOptionalValue, messageDigest DigestInfo }
+            var indirectData = reader.ReadConstructed(DerReader.TAG_SEQUENCE);
+            indirectData.Skip();
+            var digestInfo = indirectData.ReadConstructed(DerReader.TAG_SEQUENCE);
+            digestOid = digestInfo.ReadConstructed(DerReader.TAG_SEQUENCE).ReadOid();
+            digest = digestInfo.ReadBytes(DerReader.TAG_OCTET_STRING);
+        }
+
+        /// <summary>
+        /// Returns the time from a valid Authenticode (PKCS#9) countersignature, or null if the file wasn't timestamped that way.
+        /// The countersigner must chain to one of the machine's roots for timestamping, otherwise anyone with the signing key
+        /// of an expired certificate could backdate their own countersignature.
+        /// </summary>
+        /// <param name="signerInfo"></param>
+        /// <param name="extraCerts">Certificates included in the signature</param>
+        /// <returns></returns>
+        private static DateTime? GetCounterSignatureTime(SignerInfo signerInfo, X509Certificate2Collection extraCerts)
+        {
+            foreach (SignerInfo counterSigner in signerInfo.CounterSignerInfos)
+            {
+                if (counterSigner.Certificate == null)
+                {
+                    continue;
+                }
+                try
+                {
+                    counterSigner.CheckSignature(true);
+                }
+                catch (CryptographicException)
+                {
+                    continue;
+                }
+
+                DateTime? signingTime = null;
+                foreach (CryptographicAttributeObject attribute in counterSigner.SignedAttributes)
+                {
+                    if (attribute.Oid.Value != szOID_RSA_signingTime)
+                    {
+                        continue;
+                    }
+                    foreach (AsnEncodedData value in attribute.Values)
+                    {
+                        var pkcs9SigningTime = value as Pkcs9SigningTime;
+                        if (pkcs9SigningTime != null)
+                        {
+                            signingTime = pkcs9SigningTime.SigningTime.ToLocalTime();
+                        }
+                    }
+                }
+
+                if (signingTime != null && IsTimestampSigner(counterSigner.Certificate, extraCerts, signingTime.Value))
+                {
+                    return signingTime;
+                }
+            }
+            return null;
+        }
+
+        /// <summary>
+        /// Checks the countersigner's chain for timestamping against the machine's roots, as of the time it signed
+        /// </summary>
+        /// <param name="cert"></param>
+        /// <param name="extraCerts"></param>
+        /// <param name="signingTime"></param>
+        /// <returns></returns>
+        private static bool IsTimestampSigner(X509Certificate2 cert, X509Certificate2Collection extraCerts, DateTime signingTime)
+        {
+            var chain = new X509Chain();
+            try
+            {
+                chain.ChainPolicy.RevocationMode = X509RevocationMode.NoCheck;
+                chain.ChainPolicy.ApplicationPolicy.Add(new Oid(szOID_PKIX_KP_TIMESTAMP_SIGNING));
+                chain.ChainPolicy.ExtraStore.AddRange(extraCerts);
+                chain.ChainPolicy.VerificationTime = signingTime;
+
+                chain.Build(cert);
+
+                X509ChainStatusFlags status = X509ChainStatusFlags.NoError;
+                foreach (var chainStatus in chain.ChainStatus)
+                {
+                    status |= chainStatus.Status;
+                }
+                return (status & ~IGNORED_CHAIN_STATUS) == X509ChainStatusFlags.NoError;
+            }
+            finally
+            {
+                chain.Reset();
+            }
+        }
+
+        /// <summary>
+        /// Builds the signer's chain for code signing, as of the signing time if the file was timestamped.
+        /// Roots listed in the trustedRoots config value are accepted as well as the machine's.
+        /// </summary>
+        /// <param name="cert"></param>
+        /// <param name="extraCerts">Intermediates included in the signature</param>
+        /// <param name="signingTime"></param>
+        /// <returns></returns>
+        private static WinVerifyTrustResult? VerifyChain(X509Certificate2 cert, X509Certificate2Collection extraCerts, DateTime? signingTime)
+        {
+            HashSet<string> trustedRoots = GetConfiguredRoots();
+
+            var chain = new X509Chain();
+            try
+            {
+                // Same as the WTD_REVOKE_NONE we give WinVerifyTrust.  Fetching CRLs can take far longer than the decision
+                // budget on endpoints that are offline or behind a proxy.
+                chain.ChainPolicy.RevocationMode = X509RevocationMode.NoCheck;
+                chain.ChainPolicy.ApplicationPolicy.Add(new Oid(szOID_PKIX_KP_CODE_SIGNING));
+                chain.ChainPolicy.ExtraStore.AddRange(extraCerts);
+                chain.ChainPolicy.VerificationTime = signingTime ?? DateTime.Now;
+                if (trustedRoots.Count != 0)
+                {
+                    chain.ChainPolicy.VerificationFlags = X509VerificationFlags.AllowUnknownCertificateAuthority;
+                }
+
+                chain.Build(cert);
+
+                X509ChainStatusFlags status = X509ChainStatusFlags.NoError;
+                foreach (var chainStatus in chain.ChainStatus)
+                {
+                    status |= chainStatus.Status;
+                }
+                status &= ~IGNORED_CHAIN_STATUS;
+
+                if ((status & X509ChainStatusFlags.UntrustedRoot) != 0)
+                {
+                    var root = chain.ChainElements[chain.ChainElements.Count - 1].Certificate;
+                    if (!trustedRoots.Contains(root.Thumbprint))
+                    {
+                        return WinVerifyTrustResult.SubjectNotTrusted;
+                    }
+                    status &= ~X509ChainStatusFlags.UntrustedRoot;
+                }
+
+                if (status == X509ChainStatusFlags.NoError)
+                {
+                    return WinVerifyTrustResult.Success;
+                }
+                if ((status & X509ChainStatusFlags.Revoked) != 0)
+                {
+                    return WinVerifyTrustResult.SubjectCertificateRevoked;
+                }
+                if (status == X509ChainStatusFlags.NotTimeValid)
+                {
+                    // It may have a timestamp we don't read (RFC 3161), which would make it valid
+                    if (signingTime == null)
+                    {
+                        return null;
+                    }
+                    return WinVerifyTrustResult.SubjectCertExpired;
+                }
+                return WinVerifyTrustResult.SubjectNotTrusted;
+            }
+            finally
+            {
+                chain.Reset();
+            }
+        }
+
+        private static HashSet<string> GetConfiguredRoots()
+        {
+            var roots = new HashSet<string>(StringComparer.OrdinalIgnoreCase);
+            if (SRSvc.conf != null && !String.IsNullOrEmpty(SRSvc.conf.TrustedRoots))
+            {
+                foreach (var thumbprint in SRSvc.conf.TrustedRoots.Split(';'))
+                {
+                    if (thumbprint.Trim() != "")
+                    {
+                        roots.Add(thumbprint.Trim().Replace(" ", ""));
+                    }
+                }
+            }
+            return roots;
+        }
+
+        /// <summary>
+        /// Fills in the Signer and Certificate the same way WinTrust.GetSignerFromStateData does
+        /// </summary>
+        /// <param name="cert"></param>
+        /// <param name="timestamp"></param>
+        /// <returns></returns>
+        private static Signer CreateSigner(X509Certificate2 cert, DateTime timestamp)
+        {
+            // CertGetSerialNumber order is little-endian, the DB has it flipped
+            byte[] serialNumber = cert.GetSerialNumber();
+            Array.Reverse(serialNumber);
+
+            var certEntity = new Certificate
+            {
+                Version = (uint)(cert.Version - 1),  // X509Certificate2 counts from 1, CERT_INFO from 0
+                Issuer = cert.SubjectName.Decode(X500DistinguishedNameFlags.None),  // Same as CertNameToStr with CERT_X500_NAME_STR
+                SerialNumber = serialNumber,
+                DigestAlgorithm = cert.SignatureAlgorithm.Value,
+                DigestEncryptionAlgorithm = cert.PublicKey.Oid.Value
+            };
+
+            string signerName = WinTrustVerify.WinTrust.getBestName(cert.SubjectName);
+            signerName = signerName.Replace("\"", "").Trim();
+
+            return new Signer
+            {
+                Name = signerName,
+                Timestamp = timestamp,
+                SigningCert = certEntity
+            };
+        }
+    }
+}
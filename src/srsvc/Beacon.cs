@@ -13,6 +13,9 @@ using System.Linq;
 using System.Text;
 using System.Net;
 using System.IO;
+using System.IO.Compression;
+using System.Diagnostics;
+using System.Threading;
 
 using System.Runtime.Serialization;
 using System.Runtime.Serialization.Json;
@@ -28,6 +31,43 @@ namespace srsvc
     {
         bool bRunning = true;
 
+        // Limits on the process events sent in one request
+        private const int MAX_BATCH_EVENTS = 500;
+        private const int MAX_BATCH_BYTES = 512 * 1024;
+
+        /// <summary>
+        /// Process events to send to the server in one request
+        /// </summary>
+        private class ProcessEventBatch
+        {
+            public List<KeyValuePair<ProcessEvent, Executable>> Events = new List<KeyValuePair<ProcessEvent, Executable>>();
+            private long bytes = 0;
+
+            /// <summary>
+            /// Adds the event, unless the batch is full.  A batch always takes at least one event.
+            /// </summary>
+            public bool TryAdd(ProcessEvent processEvent, Executable executable)
+            {
+                int size = Event.EstimateProcessEventSize(processEvent, executable);
+                if (Events.Count >= MAX_BATCH_EVENTS || (Events.Count != 0 && bytes + size > MAX_BATCH_BYTES))
+                {
+                    return false;
+                }
+
+                Events.Add(new KeyValuePair<ProcessEvent, Executable>(processEvent, executable));
+                bytes += size;
+                return true;
+            }
+        }
+
+        // Rows read from the DB at a time when sending what's in it
+        private const int DATABASE_PAGE_SIZE = MAX_BATCH_EVENTS;
+
+        // Executables of the process events being sent, by ID.  Only the parts of them that don't change once they're
+        // recorded are sent, so they don't go stale.
+        private const int MAX_CACHED_EXECUTABLES = 10000;
+        private Dictionary<long, Executable> executables = new Dictionary<long, Executable>();
+
         private static readonly Encoding encoding = Encoding.UTF8;
 
         /// <summary>
@@ -38,11 +78,16 @@ namespace srsvc
         /// <returns></returns>
         public static string PostToServer(string postMessage, string route, string contentType = "text/json")
         {
-            return encoding.GetString(PostForm(encoding.GetBytes(postMessage), route, contentType));
+            byte[] response = PostForm(encoding.GetBytes(postMessage), route, contentType);
+            return (response == null) ? "" : encoding.GetString(response);
         }
 
+        // Size of the reads and writes when streaming a file to the server
+        private const int UPLOAD_BUFFER_SIZE = 64 * 1024;
+
         /// <summary>
-        /// Used by PostForm
+        /// Sends a multipart form to the server.  Files are streamed to the server as they're read, so memory use doesn't
+        /// grow with their size.
         /// </summary>
         /// <param name="route"></param>
         /// <param name="postParameters"></param>
@@ -52,20 +97,19 @@ namespace srsvc
             string formDataBoundary = String.Format("----------{0:N}", Guid.NewGuid());
             string contentType = "multipart/form-data; boundary=" + formDataBoundary;
 
-            byte[] formData = GetMultipartFormData(postParameters, formDataBoundary);
-
-            return encoding.GetString(PostForm(formData, route, contentType));
+            // The length of compressed files isn't known until they've been sent, so the form is sent chunked
+            byte[] response = Post(route, contentType, -1, formDataStream => WriteMultipartFormData(formDataStream, postParameters, formDataBoundary));
+            return (response == null) ? "" : encoding.GetString(response);
         }
 
         /// <summary>
-        /// Used by PostForm
+        /// Used by MultipartFormDataPost
         /// </summary>
+        /// <param name="formDataStream"></param>
         /// <param name="postParameters"></param>
         /// <param name="boundary"></param>
-        /// <returns></returns>
-        private static byte[] GetMultipartFormData(Dictionary<string, object> postParameters, string boundary)
+        private static void WriteMultipartFormData(Stream formDataStream, Dictionary<string, object> postParameters, string boundary)
         {
-            Stream formDataStream = new System.IO.MemoryStream();
             bool needsCLRF = false;
 
             foreach (var param in postParameters)
@@ -90,8 +134,19 @@ namespace srsvc
 
                     formDataStream.Write(encoding.GetBytes(header), 0, encoding.GetByteCount(header));
 
-                    // Write the file data directly to the Stream, rather than serializing it to a string.
-                    formDataStream.Write(fileToUpload.File, 0, fileToUpload.File.Length);
+                    // Copy the file data to the Stream a buffer at a time, rather than reading it all in first
+                    if (fileToUpload.Compress)
+                    {
+                        // Leave the form open, as the rest of it follows the compressed data
+                        using (var compressedStream = new GZipStream(formDataStream, CompressionMode.Compress, true))
+                        {
+                            fileToUpload.File.CopyTo(compressedStream, UPLOAD_BUFFER_SIZE);
+                        }
+                    }
+                    else
+                    {
+                        fileToUpload.File.CopyTo(formDataStream, UPLOAD_BUFFER_SIZE);
+                    }
                 }
                 else
                 {
@@ -106,25 +161,23 @@ namespace srsvc
             // Add the end of the request.  Start with a newline
             string footer = "\r\n--" + boundary + "--\r\n";
             formDataStream.Write(encoding.GetBytes(footer), 0, encoding.GetByteCount(footer));
-
-            // Dump the Stream into a byte[]
-            formDataStream.Position = 0;
-            byte[] formData = new byte[formDataStream.Length];
-            formDataStream.Read(formData, 0, formData.Length);
-            formDataStream.Close();
-
-            return formData;
         }
 
 
         public class FileParameter
         {
-            public byte[] File { get; set; }
+            public Stream File { get; set; }
             public string FileName { get; set; }
             public string ContentType { get; set; }
-            public FileParameter(byte[] file) : this(file, null) { }
-            public FileParameter(byte[] file, string filename) : this(file, filename, null) { }
-            public FileParameter(byte[] file, string filename, string contenttype)
+
+            /// <summary>
+            /// Gzip the file as it's sent
+            /// </summary>
+            public bool Compress { get; set; }
+
+            public FileParameter(Stream file) : this(file, null) { }
+            public FileParameter(Stream file, string filename) : this(file, filename, null) { }
+            public FileParameter(Stream file, string filename, string contenttype)
             {
                 File = file;
                 FileName = filename;
@@ -133,6 +186,26 @@ namespace srsvc
         }
 
 
+        /// <summary>
+        /// Connections to the server are kept open between posts, so only the first post to it pays for the TCP (and TLS)
+        /// setup.  How long an idle connection is kept, beyond the beacon interval.
+        /// </summary>
+        private static readonly TimeSpan CONNECTION_IDLE_MARGIN = TimeSpan.FromSeconds(30);
+
+        // Connections are replaced after this long regardless, so DNS changes get picked up
+        private static readonly TimeSpan CONNECTION_LEASE_TIME = TimeSpan.FromMinutes(10);
+
+        // Enough for the long poll for commands, a heartbeat, the telemetry worker and the bulk workers at once
+        private const int MAX_CONNECTIONS = 6;
+
+        static Beacon()
+        {
+            // Don't wait a round trip for "100 Continue" before sending each body
+            ServicePointManager.Expect100Continue = false;
+            ServicePointManager.UseNagleAlgorithm = false;
+            ServicePointManager.DefaultConnectionLimit = Math.Max(ServicePointManager.DefaultConnectionLimit, MAX_CONNECTIONS);
+        }
+
         /// <summary>
         /// PostForm sends data to the server.  This function and helpers were largely taken from http://www.briangrinstead.com/blog/multipart-form-post-in-c
         /// </summary>
@@ -141,6 +214,35 @@ namespace srsvc
         /// <param name="contentType"></param>
         /// <returns></returns>
         public static byte[] PostForm(byte[] formData, string route, string contentType = "text/json")
+        {
+            return Post(route, contentType, formData.Length, requestStream => requestStream.Write(formData, 0, formData.Length));
+        }
+
+        /// <summary>
+        /// Sends JSON to the server and waits up to waitSeconds (beyond the usual request timeout) for it to reply, for
+        /// requests the server holds open until it has something to say
+        /// </summary>
+        /// <param name="postMessage"></param>
+        /// <param name="route"></param>
+        /// <param name="waitSeconds"></param>
+        /// <returns>The response, which is empty if the server had nothing to say, or null on failure</returns>
+        public static byte[] LongPoll(string postMessage, string route, int waitSeconds)
+        {
+            byte[] formData = encoding.GetBytes(postMessage);
+            return Post(route, "text/json", formData.Length, requestStream => requestStream.Write(formData, 0, formData.Length), waitSeconds);
+        }
+
+        /// <summary>
+        /// Sends a request whose body is written by writeBody.  A contentLength of -1 sends the body in chunks as it's
+        /// written, rather than buffering all of it to find its length first.
+        /// </summary>
+        /// <param name="route"></param>
+        /// <param name="contentType"></param>
+        /// <param name="contentLength"></param>
+        /// <param name="writeBody"></param>
+        /// <param name="waitSeconds">Extra time the server may take to respond</param>
+        /// <returns>The response, or null on failure</returns>
+        private static byte[] Post(string route, string contentType, long contentLength, Action<Stream> writeBody, int waitSeconds = 0)
         {
             // TODO Use proxy settings
             // TODO Check HTTPS thoroughly
@@ -149,26 +251,54 @@ namespace srsvc
             byte[] result = null;
             sURL = SRSvc.conf.BeaconServer + route;
 
+            BeaconScheduler.Acquire(route);
+
             try
             {
                 var httpWebRequest = (HttpWebRequest)WebRequest.Create(sURL);
                 httpWebRequest.ContentType = contentType;
                 httpWebRequest.Method = "POST";
                 httpWebRequest.Proxy = null; // TODO REMOVE, this adds 7 seconds, so need to decide when it's needed
-                httpWebRequest.ContentLength = formData.Length;
-
-                using (Stream streamWriter = httpWebRequest.GetRequestStream())
+                if (contentLength >= 0)
                 {
-                    streamWriter.Write(formData, 0, formData.Length);
-                    streamWriter.Flush();
-                    streamWriter.Close();
+                    httpWebRequest.ContentLength = contentLength;
                 }
+                else
+                {
+                    httpWebRequest.SendChunked = true;
+                    httpWebRequest.AllowWriteStreamBuffering = false;
+                }
+                httpWebRequest.KeepAlive = true;
+                httpWebRequest.Timeout = (SRSvc.conf.BeaconRequestTimeout + waitSeconds) * 1000;
+                httpWebRequest.ReadWriteTimeout = SRSvc.conf.BeaconReadTimeout * 1000;
+
+                // All routes on the server share this, and so share its connections
+                var servicePoint = httpWebRequest.ServicePoint;
+                servicePoint.MaxIdleTime = (int)(TimeSpan.FromSeconds(SRSvc.conf.BeaconInterval) + CONNECTION_IDLE_MARGIN).TotalMilliseconds;
+                servicePoint.ConnectionLeaseTimeout = (int)CONNECTION_LEASE_TIME.TotalMilliseconds;
+
+                // Buffered so small writes (ex. from compression) don't each become their own chunk.  Closing the stream
+                // finishes the request, so if the body fails partway the request is aborted instead, and the server never
+                // sees a truncated body as a complete one.
+                Stream streamWriter = new BufferedStream(httpWebRequest.GetRequestStream(), UPLOAD_BUFFER_SIZE);
+                try
+                {
+                    writeBody(streamWriter);
+                }
+                catch
+                {
+                    httpWebRequest.Abort();
+                    throw;
+                }
+                streamWriter.Dispose();
 
-                var httpResponse = (HttpWebResponse)httpWebRequest.GetResponse();
-                using (BinaryReader br = new BinaryReader(httpResponse.GetResponseStream()))
+                // The whole response has to be read and closed for the connection to be reused
+                using (var httpResponse = (HttpWebResponse)httpWebRequest.GetResponse())
+                using (var responseStream = httpResponse.GetResponseStream())
                 {
-                    result = br.ReadBytes((int)httpResponse.ContentLength);
-                    br.Close();
+                    var responseData = new MemoryStream((httpResponse.ContentLength > 0) ? (int)httpResponse.ContentLength : 0);
+                    responseStream.CopyTo(responseData);
+                    result = responseData.ToArray();
                 }
             }
             catch (System.Net.Sockets.SocketException)
@@ -186,153 +316,294 @@ namespace srsvc
 
 
         /// <summary>
-        /// Given a server response, it does what it is being asked, and tells the server, which sends back a server reponse, which is returned by this function.
+        /// Sends the journal's process events in batches, in order, moving its cursor past each batch the server accepts
         /// </summary>
-        /// <param name="serverMsg"></param>
-        /// <returns></returns>
-        private dynamic HandleServerResponse(dynamic serverMsg)
+        /// <param name="journal"></param>
+        /// <param name="session"></param>
+        /// <param name="drainStopwatch">Started when this drain began</param>
+        /// <param name="drained">Events sent so far in this drain</param>
+        /// <param name="contactedServer">Set if we tried sending anything</param>
+        /// <returns>False if the server couldn't be reached</returns>
+        private bool SendJournal(EventJournal journal, NHibernate.ISession session, Stopwatch drainStopwatch, ref long drained, ref bool contactedServer)
         {
-            dynamic response = null;
-
-            try
+            while (bRunning)
             {
-                string command = serverMsg.Command;
+                var records = journal.Read(MAX_BATCH_EVENTS);
+                if (records.Count == 0)
+                {
+                    break;
+                }
+
+                LoadExecutables(session, records.Where(r => r.ProcessEvent != null).Select(r => r.ProcessEvent.ExecutableId));
 
-                if (command == "GetCatalogFileByHash")
+                var batch = new ProcessEventBatch();
+                long batchEnd = 0;
+                foreach (var record in records)
                 {
-                    response = Command.GetCatalogFileByHash(serverMsg);
+                    if (record.ProcessEvent != null)
+                    {
+                        Executable executable;
+                        if (!executables.TryGetValue(record.ProcessEvent.ExecutableId, out executable))
+                        {
+                            // Something broke, so just skip it
+                            Log.Error("Unable to find an executable for process event at {0:x} in {1}", record.Offset, journal);
+                        }
+                        else if (!batch.TryAdd(record.ProcessEvent, executable))
+                        {
+                            break;
+                        }
+                    }
+                    batchEnd = record.NextOffset;
                 }
-                else if (command == "GetFileByHash")
+
+                if (batch.Events.Count != 0)
                 {
-                    response = Command.GetFileByHash(serverMsg);
+                    contactedServer = true;
+                    if (!Event.PostProcessEvents(batch.Events))
+                    {
+                        // Try again from here next time
+                        return false;
+                    }
+                    Log.Info("Sent {0} process events from {1}", batch.Events.Count, journal);
                 }
-                else if (command == "SetSystemUUID")
+                journal.Acknowledge(batchEnd);
+
+                drained += batch.Events.Count;
+                ThrottleDrain(drainStopwatch, drained);
+            }
+            return true;
+        }
+
+        /// <summary>
+        /// Sends the process events in the DB a page at a time, in ID order from just past the last one sent.  Moves the
+        /// cursor past each page the server accepts, rather than marking each event as sent.
+        /// </summary>
+        /// <param name="session"></param>
+        /// <param name="drainStopwatch">Started when this drain began</param>
+        /// <param name="drained">Events sent so far in this drain</param>
+        /// <param name="contactedServer">Set if we tried sending anything</param>
+        /// <returns>False if the server couldn't be reached</returns>
+        private bool SendDatabaseEvents(NHibernate.ISession session, Stopwatch drainStopwatch, ref long drained, ref bool contactedServer)
+        {
+            long processEventCursor = GetProcessEventCursor(session);
+            while (bRunning)
+            {
+                // Only the primary key is used, so each page costs the same however many events are waiting
+                var processEvents = session.QueryOver<ProcessEvent>()
+                    .Where(e => e.Id > processEventCursor)
+                    .OrderBy(e => e.Id).Asc
+                    .Take(DATABASE_PAGE_SIZE)
+                    .List<ProcessEvent>();
+                if (processEvents.Count == 0)
                 {
-                    response = Command.SetSystemUUID(serverMsg);
+                    break;
                 }
-                else if (command == "Update")
+
+                LoadExecutables(session, processEvents.Select(e => e.ExecutableId));
+
+                var batch = new ProcessEventBatch();
+                long batchEnd = processEventCursor;
+                foreach (var processEvent in processEvents)
                 {
-                    response = Command.Update(serverMsg);
+                    // Rows marked as sent by older versions
+                    if (!processEvent.HasInformedServer)
+                    {
+                        Executable executable;
+                        if (!executables.TryGetValue(processEvent.ExecutableId, out executable))
+                        {
+                            // The executable for this process event was not found, so something broke, so just ignore it
+                            Log.Error("Unable to find an executable for process event {0}", processEvent.Id);
+                        }
+                        else if (!batch.TryAdd(processEvent, executable))
+                        {
+                            break;
+                        }
+                    }
+                    batchEnd = processEvent.Id;
                 }
-                else if (command == "NOP")
+
+                if (batch.Events.Count != 0)
                 {
-                    response = Command.NOP(serverMsg);
+                    contactedServer = true;
+                    if (!Event.PostProcessEvents(batch.Events))
+                    {
+                        return false;
+                    }
                 }
-                else if (command == "Stall")
+
+                processEventCursor = batchEnd;
+                SRSvc.conf.ProcessEventCursor = processEventCursor;
+
+                // Nothing read here is needed again, so don't let the session hold on to it
+                session.Clear();
+
+                drained += batch.Events.Count;
+                ThrottleDrain(drainStopwatch, drained);
+            }
+            return true;
+        }
+
+        /// <summary>
+        /// Returns the ID of the last process event in the DB that was sent.  The first time, as older versions marked each
+        /// event as sent instead, it's found from those marks.
+        /// </summary>
+        /// <param name="session"></param>
+        /// <returns></returns>
+        private static long GetProcessEventCursor(NHibernate.ISession session)
+        {
+            if (SRSvc.conf.ProcessEventCursor < 0)
+            {
+                var firstUnsent = session.QueryOver<ProcessEvent>()
+                    .Where(e => e.HasInformedServer == false)
+                    .OrderBy(e => e.Id).Asc
+                    .Take(1)
+                    .SingleOrDefault();
+                var last = session.QueryOver<ProcessEvent>()
+                    .OrderBy(e => e.Id).Desc
+                    .Take(1)
+                    .SingleOrDefault();
+
+                if (firstUnsent != null)
                 {
-                    response = Command.Stall(serverMsg);
+                    SRSvc.conf.ProcessEventCursor = firstUnsent.Id - 1;
                 }
                 else
                 {
-                    Log.Error("Unknown command: {0}", command);
+                    SRSvc.conf.ProcessEventCursor = (last != null) ? last.Id : 0;
                 }
             }
-            catch (RuntimeBinderException e)
+            return SRSvc.conf.ProcessEventCursor;
+        }
+
+        /// <summary>
+        /// Same as above, for catalog files
+        /// </summary>
+        /// <param name="session"></param>
+        /// <returns></returns>
+        private static long GetCatalogFileCursor(NHibernate.ISession session)
+        {
+            if (SRSvc.conf.CatalogFileCursor < 0)
             {
-                Log.Exception(e, "JSON did not include expected value");
-                return false;
+                var firstUnsent = session.QueryOver<CatalogFile>()
+                    .Where(e => e.HasInformedServer == false)
+                    .OrderBy(e => e.Id).Asc
+                    .Take(1)
+                    .SingleOrDefault();
+                var last = session.QueryOver<CatalogFile>()
+                    .OrderBy(e => e.Id).Desc
+                    .Take(1)
+                    .SingleOrDefault();
+
+                if (firstUnsent != null)
+                {
+                    SRSvc.conf.CatalogFileCursor = firstUnsent.Id - 1;
+                }
+                else
+                {
+                    SRSvc.conf.CatalogFileCursor = (last != null) ? last.Id : 0;
+                }
             }
-            return response;
+            return SRSvc.conf.CatalogFileCursor;
         }
 
-
         /// <summary>
-        /// Contacts the server from our beacon loop
+        /// Makes sure the executables with these IDs are in the cache, fetching the ones that aren't in one query
         /// </summary>
         /// <param name="session"></param>
-        /// <returns></returns>
-        public bool ContactServer(NHibernate.ISession session)
+        /// <param name="ids"></param>
+        private void LoadExecutables(NHibernate.ISession session, IEnumerable<long> ids)
         {
-            bool ContactedServer = false;
+            var missing = ids.Distinct().Where(id => !executables.ContainsKey(id)).ToArray();
+            if (missing.Length == 0) return;
 
-            // Get info about all the new process events
-            var processEvents = session.QueryOver<ProcessEvent>()
-                .Where(e => e.HasInformedServer == false)
-                .List<ProcessEvent>();
-            if (processEvents.Count() != 0)
+            if (executables.Count + missing.Length > MAX_CACHED_EXECUTABLES)
             {
-                foreach (var processEvent in processEvents)
-                {
-                    // Get info about the exe associated ith this process
+                executables.Clear();
+                missing = ids.Distinct().ToArray();
+            }
 
-                    Executable executable = null;
-                    try
-                    {
-                        executable = session.QueryOver<Executable>()
-                            .Where(e => e.Id == processEvent.ExecutableId)
-                            .List<Executable>().First();
-                    }
-                    catch (Exception e)
-                    {
-                        // TODO Need to log this error
-                        Log.Exception(e, "Unable to find an executable for process event {0}", processEvent.Id);
-                        // I'll record in the DB that we already informed the server about this broken event
-                    }
+            foreach (var executable in session.QueryOver<Executable>().WhereRestrictionOn(e => e.Id).IsIn(missing).List<Executable>())
+            {
+                executables[executable.Id] = executable;
+            }
+        }
 
-                    using (var transaction = session.BeginTransaction())
-                    {
-                        if (executable == null)
-                        {
-                            // The executable for this process event was not found, so something broke, so just ignore it
-                            processEvent.HasInformedServer = true;
-                            session.Save(processEvent);
-                            transaction.Commit();
-                        }
-                        else
-                        {
-                            if (Event.PostProcessEvent(processEvent, executable))
-                            {
-                                // Record that we sent this data to the server so we don't try sending it again
-                                processEvent.HasInformedServer = true;
-                                session.Save(processEvent);
-                                transaction.Commit();
-                            }
+        /// <summary>
+        /// Waits until sending this many events is within the drain rate
+        /// </summary>
+        /// <param name="drainStopwatch"></param>
+        /// <param name="drained"></param>
+        private static void ThrottleDrain(Stopwatch drainStopwatch, long drained)
+        {
+            int drainRate = SRSvc.conf.SpoolDrainRate;
+            if (drainRate <= 0) return;
 
-                            ContactedServer = true;
-                        }
-                    }
-                }
+            TimeSpan ahead = TimeSpan.FromSeconds((double)drained / drainRate) - drainStopwatch.Elapsed;
+            if (ahead > TimeSpan.Zero)
+            {
+                System.Threading.Thread.Sleep(ahead);
             }
+        }
 
-            // Get info about all the new catalog files
-            var catalogFiles = session.QueryOver<CatalogFile>()
-                .Where(e => e.HasInformedServer == false)
-                .List<CatalogFile>();
-            if (catalogFiles.Count() != 0)
+
+        /// <summary>
+        /// Sends the process events and catalog files that are waiting to the server.  Runs on the telemetry worker.
+        /// </summary>
+        /// <param name="session"></param>
+        /// <returns></returns>
+        public bool SendTelemetry(NHibernate.ISession session)
+        {
+            bool ContactedServer = false;
+
+            // Send the journaled process events, denied processes first, at no more than the drain rate so catching up
+            // after an outage doesn't swamp this system or the server
+            var drainStopwatch = Stopwatch.StartNew();
+            long drained = 0;
+            foreach (var journal in EventJournal.All)
             {
-                foreach (var catalogFile in catalogFiles)
+                if (!SendJournal(journal, session, drainStopwatch, ref drained, ref ContactedServer))
                 {
-                    using (var transaction = session.BeginTransaction())
-                    {
-                        if (Event.PostCatalogFile(catalogFile))
-                        {
-                            // Record that we sent this data to the server so we don't try sending it again
-                            catalogFile.HasInformedServer = true;
-                            session.Save(catalogFile);
-                            transaction.Commit();
-                        }
-                    }
-
-                    ContactedServer = true;
+                    break;
                 }
             }
 
-            if (!ContactedServer)
+            // Send the process events written to the DB, from before the journal existed or when it couldn't be opened
+            if (bRunning && !SendDatabaseEvents(session, drainStopwatch, ref drained, ref ContactedServer))
             {
-                Log.Info("Posting heartbeat");
-                dynamic eventResponse = Event.PostHeartbeatEvent();
-                int avoidInfiniteLoop = 100;
-                while (eventResponse != null)
+                return ContactedServer;
+            }
+
+            // Send the new catalog files, in ID order from just past the last one sent
+            long catalogFileCursor = GetCatalogFileCursor(session);
+            while (bRunning)
+            {
+                var catalogFiles = session.QueryOver<CatalogFile>()
+                    .Where(e => e.Id > catalogFileCursor)
+                    .OrderBy(e => e.Id).Asc
+                    .Take(DATABASE_PAGE_SIZE)
+                    .List<CatalogFile>();
+                if (catalogFiles.Count == 0)
+                {
+                    break;
+                }
+
+                foreach (var catalogFile in catalogFiles)
                 {
-                    // Sanity check, want to avoid infinite loop
-                    avoidInfiniteLoop--;
-                    if (avoidInfiniteLoop < 0)
+                    if (!catalogFile.HasInformedServer)
                     {
-                        break;
+                        ContactedServer = true;
+                        if (!Event.PostCatalogFile(catalogFile))
+                        {
+                            return ContactedServer;
+                        }
                     }
 
-                    eventResponse = HandleServerResponse(eventResponse);
+                    // Record that we sent this data to the server so we don't try sending it again.  Rows marked as sent
+                    // by older versions are skipped above.
+                    catalogFileCursor = catalogFile.Id;
+                    SRSvc.conf.CatalogFileCursor = catalogFileCursor;
                 }
+                session.Clear();
             }
 
             return ContactedServer;
@@ -344,6 +615,28 @@ namespace srsvc
             bRunning = false;
         }
 
+        // Until when the server has asked us not to contact it (see Command.Stall), in UTC ticks
+        private static long stalledUntil = 0;
+
+        /// <summary>
+        /// Stops contacting the server on our own (heartbeats, telemetry and polling for commands) for a while
+        /// </summary>
+        /// <param name="delay"></param>
+        public static void Stall(TimeSpan delay)
+        {
+            Interlocked.Exchange(ref stalledUntil, (DateTime.UtcNow + delay).Ticks);
+        }
+
+        /// <summary>
+        /// How much longer we're holding off from contacting the server, or zero if we aren't
+        /// </summary>
+        /// <returns></returns>
+        public static TimeSpan GetStallRemaining()
+        {
+            TimeSpan remaining = new DateTime(Interlocked.Read(ref stalledUntil), DateTimeKind.Utc) - DateTime.UtcNow;
+            return (remaining > TimeSpan.Zero) ? remaining : TimeSpan.Zero;
+        }
+
 
         /// <summary>
         /// Thread to contact the server periodically with any new information acquired
@@ -351,41 +644,63 @@ namespace srsvc
         public void Run()
         {
             Log.Debug("Beacon thread started");
-            bool ContactedServer = false;
 
             // Loop and sleep for 60s, and sending anything new
-            var sessionFactory = Database.getSessionFactory();
-            using (var session = sessionFactory.OpenSession())
+            while (bRunning)
             {
-                while (bRunning)
+                try
                 {
-                    try
-                    {
-                        Log.Debug("Start of loop");
+                    Log.Debug("Start of loop");
 
-                        // If we haven't contacted the server yet, then we try to post a heart beat
-                        ContactedServer = false;
-
-                        if (!SRSvc.conf.HasRegistered())
+                    if (!SRSvc.conf.HasRegistered())
+                    {
+                        Event.RegisterWithServer();
+                    }
+                    else if (GetStallRemaining() > TimeSpan.Zero)
+                    {
+                        Log.Debug("Stalled, not contacting the server for another {0}s", (int)GetStallRemaining().TotalSeconds);
+                    }
+                    else
+                    {
+                        // Telemetry goes out on its own worker, so a long backlog doesn't hold up the heartbeat.  Only one
+                        // send at a time, as each carries on from where the last left off.
+                        if (Interlocked.CompareExchange(ref sendingTelemetry, 1, 0) == 0)
                         {
-                            if (Event.RegisterWithServer())
+                            if (!BeaconScheduler.Schedule(TrafficClass.Telemetry, SendTelemetry))
                             {
-                                ContactedServer = true;
+                                sendingTelemetry = 0;
                             }
                         }
-                        else
-                        {
-                            ContactedServer = ContactServer(session);
-                        }
-                    }
-                    catch (Exception e)
-                    {
-                        Log.Exception(e, "Exception in beacon loop");
+
+                        Log.Info("Posting heartbeat");
+                        CommandExecutor.Submit(Event.PostHeartbeatEvent());
                     }
+                }
+                catch (Exception e)
+                {
+                    Log.Exception(e, "Exception in beacon loop");
+                }
+
+                System.Threading.Thread.Sleep(SRSvc.conf.BeaconInterval * 1000);
+            }
+        }
+
+        private int sendingTelemetry = 0;
 
-                    System.Threading.Thread.Sleep(SRSvc.conf.BeaconInterval * 1000);
+        private void SendTelemetry()
+        {
+            try
+            {
+                var sessionFactory = Database.getSessionFactory();
+                using (var session = sessionFactory.OpenSession())
+                {
+                    SendTelemetry(session);
                 }
             }
+            finally
+            {
+                sendingTelemetry = 0;
+            }
         }
     }
 }
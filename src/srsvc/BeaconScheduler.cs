@@ -0,0 +1,250 @@
+﻿////////////////////////////////////////////////////////////////////////////
+//
+// Summit Route End Point Protection
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+using System;
+using System.Collections.Generic;
+using System.Collections.Concurrent;
+using System.Linq;
+using System.Text;
+using System.Threading;
+using System.Diagnostics;
+
+namespace srsvc
+{
+    /// <summary>
+    /// Kinds of traffic to the server, highest priority first
+    /// </summary>
+    public enum TrafficClass { Control = 0, Telemetry, Bulk }
+
+    /// <summary>
+    /// Keeps the different kinds of traffic to the server from holding each other up.  Telemetry runs on its own worker,
+    /// so a long backlog of events doesn't delay heartbeats, and uploads run on the CommandExecutor's workers, so a large
+    /// upload doesn't delay either.
+    ///
+    /// Every request also takes a token from its class's bucket first, which limits how fast each class can send
+    /// requests.  The class of a request comes from its route.
+    /// </summary>
+    public static class BeaconScheduler
+    {
+        /// <summary>
+        /// Allows up to rate requests a second on average, in bursts of up to burst
+        /// </summary>
+        private class TokenBucket
+        {
+            private double rate;
+            private double burst;
+            private double tokens;
+            private Stopwatch refilled = Stopwatch.StartNew();
+            private object bucketLock = new object();
+
+            public TokenBucket(double rate, double burst)
+            {
+                this.rate = rate;
+                this.burst = burst;
+                this.tokens = burst;
+            }
+
+            /// <summary>
+            /// Waits for a token and takes it
+            /// </summary>
+            public void Take()
+            {
+                while (true)
+                {
+                    TimeSpan wait;
+                    lock (bucketLock)
+                    {
+                        tokens = Math.Min(burst, tokens + refilled.Elapsed.TotalSeconds * rate);
+                        refilled.Restart();
+                        if (tokens >= 1)
+                        {
+                            tokens -= 1;
+                            return;
+                        }
+                        wait = TimeSpan.FromSeconds((1 - tokens) / rate);
+                    }
+                    Thread.Sleep(wait);
+                }
+            }
+        }
+
+        private class Worker
+        {
+            public TrafficClass TrafficClass;
+            public BlockingCollection<Action> Queue;
+            public List<Thread> Threads = new List<Thread>();
+        }
+
+        // Requests a second and burst size for each class, in TrafficClass order.  Uploads go a chunk to a request, so the
+        // bulk limit also limits how much of the link they take.
+        private static readonly TokenBucket[] buckets =
+        {
+            new TokenBucket(10, 20),  // Control
+            new TokenBucket(5, 10),   // Telemetry
+            new TokenBucket(4, 8),    // Bulk
+        };
+
+        // Threads for each class that has workers
+        private const int TELEMETRY_WORKERS = 1;
+
+        private const int MAX_QUEUED_WORK = 16;
+
+        // How long Stop waits for running work, which may be partway through reading the event journals
+        private static readonly TimeSpan STOP_TIMEOUT = TimeSpan.FromSeconds(30);
+
+        private static readonly Dictionary<string, TrafficClass> ROUTE_CLASSES = new Dictionary<string, TrafficClass>(StringComparer.OrdinalIgnoreCase)
+        {
+            { "/api/v1/ProcessEvents", TrafficClass.Telemetry },
+            { "/api/v1/CatalogFileEvent", TrafficClass.Telemetry },
+            { "/api/v1/UploadFile", TrafficClass.Bulk },
+            { "/api/v1/UploadChunks", TrafficClass.Bulk },
+            { "/api/v1/UploadChunk", TrafficClass.Bulk },
+            { "/api/v1/UploadChunksComplete", TrafficClass.Bulk },
+            { "/api/v1/GetUpdate", TrafficClass.Bulk },
+        };
+
+        private static Dictionary<TrafficClass, Worker> workers = new Dictionary<TrafficClass, Worker>();
+
+        public static void Start()
+        {
+            lock (workers)
+            {
+                if (workers.Count != 0) return;
+
+                StartWorker(TrafficClass.Telemetry, TELEMETRY_WORKERS);
+            }
+        }
+
+        /// <summary>
+        /// Stops taking new work, and waits for the work already running to finish, so the event journals aren't closed
+        /// while telemetry is still reading them.  Work that was queued but not started is dropped.
+        /// </summary>
+        public static void Stop()
+        {
+            List<Worker> stopping;
+            lock (workers)
+            {
+                stopping = workers.Values.ToList();
+                workers.Clear();
+            }
+
+            foreach (var worker in stopping)
+            {
+                worker.Queue.CompleteAdding();
+
+                // Anything still queued is dropped rather than sent
+                Action work;
+                while (worker.Queue.TryTake(out work)) { }
+            }
+
+            Stopwatch waited = Stopwatch.StartNew();
+            foreach (var worker in stopping)
+            {
+                foreach (var thread in worker.Threads)
+                {
+                    TimeSpan remaining = STOP_TIMEOUT - waited.Elapsed;
+                    if (!thread.Join(remaining > TimeSpan.Zero ? remaining : TimeSpan.Zero))
+                    {
+                        Log.Error("Timed out waiting for {0} to finish", thread.Name);
+                    }
+                }
+            }
+        }
+
+        private static void StartWorker(TrafficClass trafficClass, int threadCount)
+        {
+            var worker = new Worker
+            {
+                TrafficClass = trafficClass,
+                Queue = new BlockingCollection<Action>(new ConcurrentQueue<Action>(), MAX_QUEUED_WORK)
+            };
+            for (int i = 0; i < threadCount; i++)
+            {
+                var thread = new Thread(() => WorkLoop(worker));
+                thread.Name = String.Format("Beacon{0}Thread{1}", trafficClass, i);
+                thread.IsBackground = true;
+                thread.Start();
+                worker.Threads.Add(thread);
+            }
+            workers[trafficClass] = worker;
+        }
+
+        /// <summary>
+        /// Queues work to run on the class's workers.  If the class has none, or they aren't running, the work runs on
+        /// the caller's thread.
+        /// </summary>
+        /// <param name="trafficClass"></param>
+        /// <param name="work"></param>
+        /// <returns>False if the queue was full and the work was dropped</returns>
+        public static bool Schedule(TrafficClass trafficClass, Action work)
+        {
+            Worker worker;
+            lock (workers)
+            {
+                workers.TryGetValue(trafficClass, out worker);
+            }
+
+            if (worker != null)
+            {
+                try
+                {
+                    if (worker.Queue.TryAdd(work))
+                    {
+                        return true;
+                    }
+                    Log.Warn("Too much {0} work queued, dropping some", trafficClass);
+                    return false;
+                }
+                catch (InvalidOperationException)
+                {
+                    // Stopping
+                }
+            }
+
+            Run(work);
+            return true;
+        }
+
+        /// <summary>
+        /// Waits until a request to the route is within its class's rate limit
+        /// </summary>
+        /// <param name="route"></param>
+        public static void Acquire(string route)
+        {
+            buckets[(int)GetTrafficClass(route)].Take();
+        }
+
+        public static TrafficClass GetTrafficClass(string route)
+        {
+            TrafficClass trafficClass;
+            return ROUTE_CLASSES.TryGetValue(route, out trafficClass) ? trafficClass : TrafficClass.Control;
+        }
+
+        private static void WorkLoop(Worker worker)
+        {
+            foreach (var work in worker.Queue.GetConsumingEnumerable())
+            {
+                Run(work);
+            }
+            Log.Debug("{0} worker stopped", worker.TrafficClass);
+        }
+
+        private static void Run(Action work)
+        {
+            try
+            {
+                work();
+            }
+            catch (Exception e)
+            {
+                Log.Exception(e, "Exception in beacon work");
+            }
+        }
+    }
+}
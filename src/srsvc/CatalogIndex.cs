@@ -0,0 +1,590 @@
+﻿////////////////////////////////////////////////////////////////////////////
+//
+// Summit Route End Point Protection
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+using System.IO;
+using System.Threading;
+using System.Security.Cryptography;
+
+namespace srsvc
+{
+    /// <summary>
+    /// Index of every member hash in the system's catalog files, so finding the catalog that signs a file is a dictionary
+    /// lookup instead of CryptCATAdminEnumCatalogFromHash searching the catalogs for every new executable.
+    ///
+    /// The catalogs are parsed once and the index is saved next to the DB.  On startup only catalogs that were added or
+    /// changed since then are parsed, and a FileSystemWatcher on CatRoot triggers the same incremental refresh.
+    /// </summary>
+    public static class CatalogIndex
+    {
+        private const string INDEX_FILE_NAME = "catalogs.idx";
+        private const uint INDEX_MAGIC = 0x49435253; // "SRCI"
+        private const int INDEX_VERSION = 2;  // 2: Paths are sorted and prefix compressed
+
+        // Wait this long after a change in CatRoot before refreshing, as installers write catalogs in bursts
+        private const int REFRESH_DELAY_MS = 2000;
+
+        // After a refresh fails, try again after this long if nothing in CatRoot changes first
+        private static readonly TimeSpan REFRESH_RETRY_INTERVAL = TimeSpan.FromMinutes(5);
+
+        private const string szOID_PKCS_7_SIGNED = "1.2.840.113549.1.7.2";
+        private const string szOID_CTL = "1.3.6.1.4.1.311.10.1";
+        private const string SPC_INDIRECT_DATA_OBJID = "1.3.6.1.4.1.311.2.1.4";
+
+        /// <summary>
+        /// A catalog file and the member hashes it lists
+        /// </summary>
+        public class CatalogEntry
+        {
+            public string Path;
+            public long LastWriteTimeUtc;  // Ticks, used to detect changes
+            public long Size;
+            public byte[] Sha256;  // Hash of the catalog file itself
+            public List<byte[]> Members = new List<byte[]>();
+        }
+
+        /// <summary>
+        /// Dictionary key for a member hash, its first 16 bytes.  A full CatRoot has a few hundred thousand members, and
+        /// keying them by hex strings took hundreds of MB in our 32-bit process.
+        /// </summary>
+        private struct MemberKey : IEquatable<MemberKey>
+        {
+            private readonly ulong high;
+            private readonly ulong low;
+
+            public MemberKey(byte[] hash)
+            {
+                high = ReadUInt64(hash, 0);
+                low = ReadUInt64(hash, 8);
+            }
+
+            private static ulong ReadUInt64(byte[] hash, int offset)
+            {
+                ulong value = 0;
+                for (int i = offset; i < offset + 8 && i < hash.Length; i++)
+                {
+                    value = (value << 8) | hash[i];
+                }
+                return value;
+            }
+
+            public bool Equals(MemberKey other)
+            {
+                return high == other.high && low == other.low;
+            }
+
+            public override bool Equals(object obj)
+            {
+                return obj is MemberKey && Equals((MemberKey)obj);
+            }
+
+            public override int GetHashCode()
+            {
+                // The hash is already uniformly distributed
+                return (int)low;
+            }
+        }
+
+        /// <summary>
+        /// The full member hash, to compare against on a hit, and the catalog listing it
+        /// </summary>
+        private struct Member
+        {
+            public byte[] Hash;
+            public CatalogEntry Catalog;
+        }
+
+        /// <summary>
+        /// Index contents.  A snapshot is never modified once published, so lookups don't need a lock.
+        /// </summary>
+        private class Snapshot
+        {
+            public Dictionary<string, CatalogEntry> Catalogs = new Dictionary<string, CatalogEntry>(StringComparer.OrdinalIgnoreCase);
+            public Dictionary<MemberKey, Member> Members = new Dictionary<MemberKey, Member>();
+        }
+
+        private static volatile Snapshot current = null;
+        private static volatile bool isCurrent = false;
+        private static int changeCount = 0;  // Bumped for every change seen in CatRoot
+        private static bool bRunning = false;
+
+        private static Thread refreshThread = null;
+        private static AutoResetEvent refreshRequested = new AutoResetEvent(false);
+        private static FileSystemWatcher watcher = null;
+
+        /// <summary>
+        /// True when the index reflects every catalog on the system, so a hash missing from it is in no catalog.
+        /// </summary>
+        public static bool IsCurrent
+        {
+            get { return isCurrent; }
+        }
+
+        /// <summary>
+        /// Returns the catalog listing the given member hash, or null
+        /// </summary>
+        /// <param name="hash"></param>
+        /// <returns></returns>
+        public static CatalogEntry Lookup(byte[] hash)
+        {
+            Snapshot snapshot = current;
+            if (snapshot == null)
+            {
+                return null;
+            }
+
+            Member member;
+            if (snapshot.Members.TryGetValue(new MemberKey(hash), out member) && Helpers.ByteArrayAreEqual(member.Hash, hash))
+            {
+                return member.Catalog;
+            }
+            return null;
+        }
+
+        /// <summary>
+        /// Directory holding the catalog databases, one sub-directory per subsystem GUID.
+        /// It's exempt from WOW64 redirection, so this works from our 32-bit process.
+        /// </summary>
+        /// <returns></returns>
+        private static string GetCatRootPath()
+        {
+            return Path.Combine(Environment.GetFolderPath(Environment.SpecialFolder.System), "CatRoot");
+        }
+
+        /// <summary>
+        /// Loads the saved index and starts the thread that keeps it up to date
+        /// </summary>
+        public static void Start()
+        {
+            if (bRunning) return;
+            bRunning = true;
+
+            refreshThread = new Thread(new ThreadStart(RefreshLoop));
+            refreshThread.Name = "CatalogIndexThread";
+            refreshThread.IsBackground = true;
+            refreshThread.Priority = ThreadPriority.BelowNormal;
+            refreshThread.Start();
+        }
+
+        public static void Stop()
+        {
+            bRunning = false;
+            refreshRequested.Set();
+            if (watcher != null)
+            {
+                watcher.EnableRaisingEvents = false;
+            }
+        }
+
+        /// <summary>
+        /// Something in CatRoot changed, so until we've re-read it, misses in the index can't be trusted
+        /// </summary>
+        private static void OnCatRootChanged(object sender, FileSystemEventArgs e)
+        {
+            isCurrent = false;
+            Interlocked.Increment(ref changeCount);
+            refreshRequested.Set();
+        }
+
+        private static void RefreshLoop()
+        {
+            try
+            {
+                current = LoadIndex();
+
+                try
+                {
+                    watcher = new FileSystemWatcher(GetCatRootPath(), "*.cat");
+                    watcher.IncludeSubdirectories = true;
+                    watcher.NotifyFilter = NotifyFilters.FileName | NotifyFilters.LastWrite | NotifyFilters.Size;
+                    watcher.Created += OnCatRootChanged;
+                    watcher.Changed += OnCatRootChanged;
+                    watcher.Deleted += OnCatRootChanged;
+                    watcher.Renamed += (s, e) => OnCatRootChanged(s, e);
+                    watcher.Error += (s, e) => OnCatRootChanged(s, null);
+                    watcher.EnableRaisingEvents = true;
+                }
+                catch (Exception e)
+                {
+                    // Without a watcher we can't tell when catalogs change, so keep falling back to Windows' own lookup
+                    Log.Exception(e, "Unable to watch the catalog directory");
+                }
+
+                while (bRunning)
+                {
+                    bool refreshed = false;
+                    try
+                    {
+                        Refresh();
+                        refreshed = true;
+                    }
+                    catch (Exception e)
+                    {
+                        // Ex. CatRoot briefly unreadable.  Lookups fall back to Windows until a refresh succeeds.
+                        Log.Exception(e, "Unable to refresh the catalog index, retrying in {0} minutes", REFRESH_RETRY_INTERVAL.TotalMinutes);
+                        isCurrent = false;
+                    }
+
+                    if (refreshed)
+                    {
+                        refreshRequested.WaitOne();
+                    }
+                    else
+                    {
+                        refreshRequested.WaitOne(REFRESH_RETRY_INTERVAL);
+                    }
+                    if (!bRunning) break;
+
+                    // Let a burst of catalog writes finish before reading them
+                    Thread.Sleep(REFRESH_DELAY_MS);
+                    refreshRequested.Reset();
+                }
+            }
+            catch (Exception e)
+            {
+                Log.Exception(e, "Exception in catalog index thread");
+                isCurrent = false;
+            }
+        }
+
+        /// <summary>
+        /// Brings the index up to date with what's in CatRoot, parsing only catalogs that are new or changed
+        /// </summary>
+        private static void Refresh()
+        {
+            // Only claim to be current if every catalog was read and nothing changed while we were scanning
+            bool watching = (watcher != null && watcher.EnableRaisingEvents);
+            int changesBefore = Thread.VolatileRead(ref changeCount);
+
+            Snapshot previous = current ?? new Snapshot();
+            var next = new Snapshot();
+            int parsed = 0;
+            int failed = 0;
+
+            foreach (var subsystem in Directory.GetDirectories(GetCatRootPath()))
+            {
+                foreach (var catalogPath in Directory.GetFiles(subsystem, "*.cat"))
+                {
+                    try
+                    {
+                        var info = new FileInfo(catalogPath);
+                        CatalogEntry entry;
+                        if (!previous.Catalogs.TryGetValue(catalogPath, out entry) ||
+                            entry.LastWriteTimeUtc != info.LastWriteTimeUtc.Ticks ||
+                            entry.Size != info.Length)
+                        {
+                            entry = ParseCatalog(catalogPath);
+                            parsed++;
+                        }
+                        AddToSnapshot(next, entry);
+                    }
+                    catch (Exception e)
+                    {
+                        // Catalogs we can't read are left for CryptCATAdminEnumCatalogFromHash to deal with
+                        Log.Warn("Unable to index catalog {0}: {1}", catalogPath, e.Message);
+                        failed++;
+                    }
+                }
+            }
+
+            current = next;
+            Log.Info("Catalog index has {0} catalogs and {1} member hashes ({2} parsed, {3} failed)", next.Catalogs.Count, next.Members.Count, parsed, failed);
+
+            if (parsed != 0 || next.Catalogs.Count != previous.Catalogs.Count)
+            {
+                SaveIndex(next);
+            }
+
+            isCurrent = watching && failed == 0 && Thread.VolatileRead(ref changeCount) == changesBefore;
+        }
+
+        private static void AddToSnapshot(Snapshot snapshot, CatalogEntry entry)
+        {
+            snapshot.Catalogs[entry.Path] = entry;
+            foreach (var member in entry.Members)
+            {
+                var key = new MemberKey(member);
+                if (!snapshot.Members.ContainsKey(key))
+                {
+                    // Shares the catalog's copy of the hash
+                    snapshot.Members[key] = new Member { Hash = member, Catalog = entry };
+                }
+            }
+        }
+
+        /// <summary>
+        /// Reads a catalog file, hashing it and listing its members
+        /// </summary>
+        /// <param name="catalogPath"></param>
+        /// <returns></returns>
+        public static CatalogEntry ParseCatalog(string catalogPath)
+        {
+            var info = new FileInfo(catalogPath);
+            byte[] catalog = File.ReadAllBytes(catalogPath);
+
+            var entry = new CatalogEntry
+            {
+                Path = catalogPath,
+                LastWriteTimeUtc = info.LastWriteTimeUtc.Ticks,
+                Size = catalog.Length,
+                Members = ReadMemberHashes(catalog)
+            };
+
+            using (var sha256 = new SHA256Cng())
+            {
+                entry.Sha256 = sha256.ComputeHash(catalog);
+            }
+
+            return entry;
+        }
+
+        /// <summary>
+        /// Pulls the member hashes out of a catalog, which is a PKCS#7 SignedData wrapping a certificate trust list (CTL).
+        /// Each trusted subject in the CTL is a member.  Its SPC_INDIRECT_DATA attribute holds the file's hash, and for
+        /// members added by hash the subject identifier is also that hash as a UTF-16 hex string.
+        /// </summary>
+        /// <param name="catalog"></param>
+        /// <returns></returns>
+        public static List<byte[]> ReadMemberHashes(byte[] catalog)
+        {
+            var hashes = new List<byte[]>();
+
+            var contentInfo = new DerReader(catalog).ReadConstructed(DerReader.TAG_SEQUENCE);
+            if (contentInfo.ReadOid() != szOID_PKCS_7_SIGNED)
+            {
+                throw new InvalidDataException("Catalog is not PKCS#7 SignedData");
+            }
+
+            var signedData = contentInfo.ReadConstructed(DerReader.TAG_CONTEXT_0).ReadConstructed(DerReader.TAG_SEQUENCE);
+            signedData.Skip();  // version
+            signedData.Skip();  // digestAlgorithms
+
+            var encapsulated = signedData.ReadConstructed(DerReader.TAG_SEQUENCE);
+            if (encapsulated.ReadOid() != szOID_CTL)
+            {
+                throw new InvalidDataException("Catalog content is not a CTL");
+            }
+
+            // PKCS#7 puts the CTL directly in the [0], CMS wraps it in an OCTET STRING
+            var content = encapsulated.ReadConstructed(DerReader.TAG_CONTEXT_0);
+            if (content.PeekTag() == DerReader.TAG_OCTET_STRING)
+            {
+                content = new DerReader(content.ReadBytes(DerReader.TAG_OCTET_STRING));
+            }
+            var ctl = content.ReadConstructed(DerReader.TAG_SEQUENCE);
+
+            // The CTL has optional fields, but trustedSubjects is always its third SEQUENCE (after subjectUsage and subjectAlgorithm)
+            DerReader subjects = null;
+            int sequenceCount = 0;
+            while (ctl.HasData && subjects == null)
+            {
+                if (ctl.PeekTag() == DerReader.TAG_SEQUENCE && ++sequenceCount == 3)
+                {
+                    subjects = ctl.ReadConstructed(DerReader.TAG_SEQUENCE);
+                }
+                else
+                {
+                    ctl.Skip();
+                }
+            }
+            if (subjects == null)
+            {
+                // Catalog with no members
+                return hashes;
+            }
+
+            while (subjects.HasData)
+            {
+                try
+                {
+                    ReadMember(subjects.ReadConstructed(DerReader.TAG_SEQUENCE), hashes);
+                }
+                catch (InvalidDataException e)
+                {
+                    Log.Debug("Skipping unreadable catalog member: {0}", e.Message);
+                }
+            }
+
+            return hashes;
+        }
+
+        private static void ReadMember(DerReader subject, List<byte[]> hashes)
+        {
+            byte[] identifier = subject.ReadBytes(DerReader.TAG_OCTET_STRING);
+            byte[] tagHash = HashFromMemberTag(identifier);
+            if (tagHash != null)
+            {
+                hashes.Add(tagHash);
+            }
+
+            if (!subject.HasData || subject.PeekTag() != DerReader.TAG_SET)
+            {
+                return;
+            }
+
+            var attributes = subject.ReadConstructed(DerReader.TAG_SET);
+            while (attributes.HasData)
+            {
+                var attribute = attributes.ReadConstructed(DerReader.TAG_SEQUENCE);
+                if (attribute.ReadOid() != SPC_INDIRECT_DATA_OBJID)
+                {
+                    continue;
+                }
+
+                var values = attribute.ReadConstructed(DerReader.TAG_SET);
+                if (!values.HasData)
+                {
+                    continue;
+                }
+                if (values.PeekTag() == DerReader.TAG_OCTET_STRING)
+                {
+                    values = new DerReader(values.ReadBytes(DerReader.TAG_OCTET_STRING));
+                }
+
+                // SpcIndirectDataContent ::= SEQUENCE { data SpcAttributeTypeAndOptionalValue, messageDigest DigestInfo }
+                var indirectData = values.ReadConstructed(DerReader.TAG_SEQUENCE);
+                indirectData.Skip();
+                var digestInfo = indirectData.ReadConstructed(DerReader.TAG_SEQUENCE);
+                digestInfo.Skip();  // digestAlgorithm
+                byte[] digest = digestInfo.ReadBytes(DerReader.TAG_OCTET_STRING);
+
+                if (tagHash == null || !Helpers.ByteArrayAreEqual(tagHash, digest))
+                {
+                    hashes.Add(digest);
+                }
+            }
+        }
+
+        /// <summary>
+        /// Member tags for files added by hash are the SHA1 or SHA256 as a UTF-16 hex string.  Returns null for other tags.
+        /// </summary>
+        /// <param name="identifier"></param>
+        /// <returns></returns>
+        private static byte[] HashFromMemberTag(byte[] identifier)
+        {
+            string tag = Encoding.Unicode.GetString(identifier).TrimEnd('\0');
+            if (tag.Length != 40 && tag.Length != 64)
+            {
+                return null;
+            }
+            foreach (char c in tag)
+            {
+                if (!Uri.IsHexDigit(c))
+                {
+                    return null;
+                }
+            }
+            return Helpers.HexStringToByteArray(tag);
+        }
+
+        /*---------------------------------------------------------------------- */
+        // Persistence
+
+        private static Snapshot LoadIndex()
+        {
+            var snapshot = new Snapshot();
+            string indexPath = Database.GetDataFilePath(INDEX_FILE_NAME);
+            if (!File.Exists(indexPath))
+            {
+                return snapshot;
+            }
+
+            try
+            {
+                using (var reader = new BinaryReader(File.OpenRead(indexPath)))
+                {
+                    if (reader.ReadUInt32() != INDEX_MAGIC || reader.ReadInt32() != INDEX_VERSION)
+                    {
+                        Log.Warn("Catalog index is from a different version, rebuilding it");
+                        return snapshot;
+                    }
+
+                    int catalogCount = reader.ReadInt32();
+                    string previousPath = "";
+                    for (int i = 0; i < catalogCount; i++)
+                    {
+                        var entry = new CatalogEntry();
+                        entry.Path = StringTable.ReadPrefixCompressed(reader, previousPath);
+                        previousPath = entry.Path;
+                        entry.LastWriteTimeUtc = reader.ReadInt64();
+                        entry.Size = reader.ReadInt64();
+                        entry.Sha256 = reader.ReadBytes(reader.ReadByte());
+
+                        int memberCount = reader.ReadInt32();
+                        entry.Members = new List<byte[]>(memberCount);
+                        for (int j = 0; j < memberCount; j++)
+                        {
+                            entry.Members.Add(reader.ReadBytes(reader.ReadByte()));
+                        }
+
+                        AddToSnapshot(snapshot, entry);
+                    }
+                }
+            }
+            catch (Exception e)
+            {
+                Log.Exception(e, "Unable to read catalog index, rebuilding it");
+                return new Snapshot();
+            }
+
+            Log.Info("Loaded catalog index with {0} catalogs", snapshot.Catalogs.Count);
+            return snapshot;
+        }
+
+        private static void SaveIndex(Snapshot snapshot)
+        {
+            string indexPath = Database.GetDataFilePath(INDEX_FILE_NAME);
+            string tempPath = indexPath + ".tmp";
+
+            try
+            {
+                using (var writer = new BinaryWriter(File.Create(tempPath)))
+                {
+                    writer.Write(INDEX_MAGIC);
+                    writer.Write(INDEX_VERSION);
+                    writer.Write(snapshot.Catalogs.Count);
+                    string previousPath = "";
+                    foreach (var entry in snapshot.Catalogs.Values.OrderBy(e => e.Path, StringComparer.Ordinal))
+                    {
+                        StringTable.WritePrefixCompressed(writer, previousPath, entry.Path);
+                        previousPath = entry.Path;
+                        writer.Write(entry.LastWriteTimeUtc);
+                        writer.Write(entry.Size);
+                        writer.Write((byte)entry.Sha256.Length);
+                        writer.Write(entry.Sha256);
+
+                        writer.Write(entry.Members.Count);
+                        foreach (var member in entry.Members)
+                        {
+                            writer.Write((byte)member.Length);
+                            writer.Write(member);
+                        }
+                    }
+                }
+
+                // Swap in the new file so a crash never leaves a half written index
+                if (File.Exists(indexPath))
+                {
+                    File.Replace(tempPath, indexPath, null);
+                }
+                else
+                {
+                    File.Move(tempPath, indexPath);
+                }
+            }
+            catch (Exception e)
+            {
+                Log.Exception(e, "Unable to save catalog index");
+            }
+        }
+    }
+}
@@ -0,0 +1,114 @@
+﻿////////////////////////////////////////////////////////////////////////////
+//
+// Summit Route End Point Protection
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+using System.Threading;
+
+namespace srsvc
+{
+    /// <summary>
+    /// Gets commands from the server as soon as it has them, rather than when it's next sent a heartbeat.  Keeps a request
+    /// open to the server (a long poll), which the server answers when it has a command or after CommandWaitTime seconds
+    /// with nothing, and then opens another.  With the default wait, an idle endpoint sends one small request a minute on
+    /// a kept alive connection.
+    ///
+    /// When the server can't be reached, or doesn't support this, it's retried after a random delay that grows up to the
+    /// beacon interval, so endpoints don't all reconnect at once after an outage.
+    /// </summary>
+    class CommandChannel
+    {
+        bool bRunning = true;
+
+        private static readonly TimeSpan MIN_BACKOFF = TimeSpan.FromSeconds(1);
+
+        // How long to wait before checking again when we're not registered or polling is turned off
+        private static readonly TimeSpan IDLE_CHECK_INTERVAL = TimeSpan.FromSeconds(60);
+
+        private ManualResetEvent stopEvent = new ManualResetEvent(false);
+        private Random random = new Random();
+
+        public void Stop()
+        {
+            bRunning = false;
+            stopEvent.Set();
+        }
+
+        /// <summary>
+        /// Thread to wait on the server for commands
+        /// </summary>
+        public void Run()
+        {
+            Log.Debug("Command channel thread started");
+            int failures = 0;
+
+            while (bRunning)
+            {
+                TimeSpan delay = TimeSpan.Zero;
+                try
+                {
+                    int waitSeconds = SRSvc.conf.CommandWaitTime;
+                    if (waitSeconds <= 0 || !SRSvc.conf.HasRegistered())
+                    {
+                        delay = IDLE_CHECK_INTERVAL;
+                    }
+                    else if (Beacon.GetStallRemaining() > TimeSpan.Zero)
+                    {
+                        delay = Beacon.GetStallRemaining();
+                    }
+                    else
+                    {
+                        dynamic command;
+                        if (Event.PollForCommand(waitSeconds, out command))
+                        {
+                            failures = 0;
+                            if (command != null)
+                            {
+                                CommandExecutor.Submit(command);
+                            }
+                        }
+                        else
+                        {
+                            failures++;
+                            delay = GetBackoff(failures);
+                            Log.Debug("Unable to poll for commands, retrying in {0}s", (int)delay.TotalSeconds);
+                        }
+                    }
+                }
+                catch (Exception e)
+                {
+                    Log.Exception(e, "Exception in command channel loop");
+                    failures++;
+                    delay = GetBackoff(failures);
+                }
+
+                if (delay > TimeSpan.Zero)
+                {
+                    stopEvent.WaitOne(delay);
+                }
+            }
+        }
+
+        /// <summary>
+        /// Returns a random delay between a second and a limit that doubles with each failure, up to the beacon interval
+        /// </summary>
+        /// <param name="failures"></param>
+        /// <returns></returns>
+        private TimeSpan GetBackoff(int failures)
+        {
+            double maxSeconds = Math.Max(SRSvc.conf.BeaconInterval, MIN_BACKOFF.TotalSeconds);
+            double limit = Math.Min(maxSeconds, MIN_BACKOFF.TotalSeconds * Math.Pow(2, Math.Min(failures, 30)));
+
+            // Never retry immediately, so a server that fails fast isn't hammered
+            return TimeSpan.FromSeconds(MIN_BACKOFF.TotalSeconds + random.NextDouble() * (limit - MIN_BACKOFF.TotalSeconds));
+        }
+    }
+}
@@ -0,0 +1,378 @@
+﻿////////////////////////////////////////////////////////////////////////////
+//
+// Summit Route End Point Protection
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+using System;
+using System.Collections.Generic;
+using System.Collections.Concurrent;
+using System.Linq;
+using System.Text;
+using System.Threading;
+using System.Diagnostics;
+using System.Globalization;
+
+using Microsoft.CSharp.RuntimeBinder;
+
+namespace srsvc
+{
+    /// <summary>
+    /// Runs the commands the server sends, from heartbeats, the command channel and replies to other commands, on a small
+    /// pool of workers, so a long upload doesn't hold up the commands behind it.  Commands that change what the others rely
+    /// on (the system's identity or the service itself) run with nothing else running.
+    ///
+    /// A server message is either one command, or has a Commands list of them.  Each may have a CommandId, and one that is
+    /// already queued or running isn't run again.  How each command went is sent back to the server in batches, when
+    /// nothing is left to run, when a batch fills, or every few seconds while a long command is running.
+    /// </summary>
+    public static class CommandExecutor
+    {
+        private class PendingCommand
+        {
+            public string Id;
+            public string Name;
+            public dynamic Message;
+
+            // How many commands in a row led to this one, each sent in reply to the one before
+            public int Depth;
+        }
+
+        private class FinishedCommand
+        {
+            public Event.CommandResult Result;
+            public int Depth;
+        }
+
+        private const int WORKERS = 4;
+        private const int MAX_QUEUED_COMMANDS = 100;
+
+        // Sanity check, want to avoid an endless chain of replies
+        private const int MAX_COMMAND_DEPTH = 100;
+
+        private const int MAX_RESULTS_PER_POST = 50;
+        private static readonly TimeSpan RESULT_FLUSH_INTERVAL = TimeSpan.FromSeconds(5);
+
+        private static readonly HashSet<string> EXCLUSIVE_COMMANDS = new HashSet<string> { "SetSystemUUID", "Update" };
+
+        private static BlockingCollection<PendingCommand> queue = null;
+        private static Timer flushTimer = null;
+        private static object startLock = new object();
+
+        // Held for reading by most commands, and for writing by the exclusive ones
+        private static ReaderWriterLockSlim exclusiveLock = new ReaderWriterLockSlim();
+
+        // Server given IDs of commands that are queued or running
+        private static ConcurrentDictionary<string, bool> activeIds = new ConcurrentDictionary<string, bool>();
+
+        private static ConcurrentQueue<FinishedCommand> results = new ConcurrentQueue<FinishedCommand>();
+        private static object flushLock = new object();
+
+        // Commands queued or running
+        private static int outstanding = 0;
+        private static long lastLocalId = 0;
+
+        public static void Start()
+        {
+            lock (startLock)
+            {
+                if (queue != null) return;
+
+                queue = new BlockingCollection<PendingCommand>(new ConcurrentQueue<PendingCommand>(), MAX_QUEUED_COMMANDS);
+                for (int i = 0; i < WORKERS; i++)
+                {
+                    var thread = new Thread(() => WorkLoop(queue));
+                    thread.Name = String.Format("CommandThread{0}", i);
+                    thread.IsBackground = true;
+                    thread.Start();
+                }
+                flushTimer = new Timer(state => FlushResults(), null, RESULT_FLUSH_INTERVAL, RESULT_FLUSH_INTERVAL);
+            }
+        }
+
+        /// <summary>
+        /// Stops taking new commands.  Commands already running are left to finish.
+        /// </summary>
+        public static void Stop()
+        {
+            lock (startLock)
+            {
+                if (queue == null) return;
+
+                queue.CompleteAdding();
+                queue = null;
+                flushTimer.Dispose();
+                flushTimer = null;
+            }
+        }
+
+        /// <summary>
+        /// Queues the commands in a message from the server.  If the workers aren't running, they're run on the caller's
+        /// thread.
+        /// </summary>
+        /// <param name="serverMsg">May be null if the server had nothing</param>
+        public static void Submit(dynamic serverMsg)
+        {
+            Submit(serverMsg, 0);
+        }
+
+        /// <summary>
+        /// Queues the commands in a message from the server
+        /// </summary>
+        /// <param name="serverMsg"></param>
+        /// <param name="depth">How many commands in a row led to this message</param>
+        private static void Submit(dynamic serverMsg, int depth)
+        {
+            if (serverMsg == null)
+            {
+                return;
+            }
+
+            if (depth >= MAX_COMMAND_DEPTH)
+            {
+                Log.Error("Too many commands in a row from the server, ignoring the rest");
+                return;
+            }
+
+            try
+            {
+                if (serverMsg.Commands != null)
+                {
+                    foreach (dynamic command in serverMsg.Commands)
+                    {
+                        Enqueue(command, depth);
+                    }
+                }
+                else if (serverMsg.Command != null)
+                {
+                    Enqueue(serverMsg, depth);
+                }
+            }
+            catch (RuntimeBinderException e)
+            {
+                Log.Exception(e, "JSON did not include expected value");
+            }
+        }
+
+        private static void Enqueue(dynamic serverMsg, int depth)
+        {
+            var command = new PendingCommand { Message = serverMsg, Depth = depth };
+            string id;
+            try
+            {
+                // IDs may be numbers or strings
+                object commandId = serverMsg.CommandId;
+                id = Convert.ToString(commandId, CultureInfo.InvariantCulture);
+                command.Name = serverMsg.Command;
+            }
+            catch (RuntimeBinderException e)
+            {
+                // Skip just this one, so the rest of a list of commands still runs
+                Log.Exception(e, "JSON did not include expected value");
+                return;
+            }
+
+            if (String.IsNullOrEmpty(id))
+            {
+                command.Id = "local-" + Interlocked.Increment(ref lastLocalId);
+            }
+            else
+            {
+                if (!activeIds.TryAdd(id, true))
+                {
+                    Log.Debug("Command {0} is already queued", id);
+                    return;
+                }
+                command.Id = id;
+            }
+
+            Interlocked.Increment(ref outstanding);
+
+            var commands = queue;
+            if (commands != null)
+            {
+                try
+                {
+                    if (commands.TryAdd(command))
+                    {
+                        return;
+                    }
+
+                    Log.Warn("Too many commands queued, dropping {0} {1}", command.Name, command.Id);
+                    Finished(command, new Event.CommandResult { CommandId = command.Id, Command = command.Name, Status = "Dropped" });
+                    return;
+                }
+                catch (InvalidOperationException)
+                {
+                    // Stopping
+                }
+            }
+
+            Run(command);
+        }
+
+        private static void WorkLoop(BlockingCollection<PendingCommand> commands)
+        {
+            foreach (var command in commands.GetConsumingEnumerable())
+            {
+                try
+                {
+                    Run(command);
+                }
+                catch (Exception e)
+                {
+                    Log.Exception(e, "Exception in command worker");
+                }
+            }
+            Log.Debug("Command worker stopped");
+        }
+
+        private static void Run(PendingCommand command)
+        {
+            var result = new Event.CommandResult { CommandId = command.Id, Command = command.Name };
+            dynamic response = null;
+
+            bool exclusive = EXCLUSIVE_COMMANDS.Contains(command.Name);
+            if (exclusive)
+            {
+                exclusiveLock.EnterWriteLock();
+            }
+            else
+            {
+                exclusiveLock.EnterReadLock();
+            }
+
+            Stopwatch stopwatch = Stopwatch.StartNew();
+            try
+            {
+                response = Dispatch(command, result);
+            }
+            catch (RuntimeBinderException e)
+            {
+                Log.Exception(e, "JSON did not include expected value");
+                result.Status = "Failed";
+                result.Error = e.Message;
+            }
+            catch (Exception e)
+            {
+                Log.Exception(e, "Exception running command {0} {1}", command.Name, command.Id);
+                result.Status = "Failed";
+                result.Error = e.Message;
+            }
+            finally
+            {
+                if (exclusive)
+                {
+                    exclusiveLock.ExitWriteLock();
+                }
+                else
+                {
+                    exclusiveLock.ExitReadLock();
+                }
+            }
+            result.DurationMs = stopwatch.ElapsedMilliseconds;
+
+            // The server's reply to a command is more commands, which are counted before this one is finished, so the
+            // results aren't sent while they're still to come
+            Submit(response, command.Depth + 1);
+            Finished(command, result);
+        }
+
+        /// <summary>
+        /// Does what the command asks
+        /// </summary>
+        /// <param name="command"></param>
+        /// <param name="result">Has its Status set</param>
+        /// <returns>The server's response, if the command told it something</returns>
+        private static dynamic Dispatch(PendingCommand command, Event.CommandResult result)
+        {
+            dynamic response = null;
+            result.Status = "Succeeded";
+
+            if (command.Name == "GetCatalogFileByHash")
+            {
+                response = Command.GetCatalogFileByHash(command.Message);
+            }
+            else if (command.Name == "GetFileByHash")
+            {
+                response = Command.GetFileByHash(command.Message);
+            }
+            else if (command.Name == "SetSystemUUID")
+            {
+                response = Command.SetSystemUUID(command.Message);
+            }
+            else if (command.Name == "Update")
+            {
+                response = Command.Update(command.Message);
+            }
+            else if (command.Name == "NOP")
+            {
+                response = Command.NOP(command.Message);
+            }
+            else if (command.Name == "Stall")
+            {
+                response = Command.Stall(command.Message);
+            }
+            else
+            {
+                Log.Error("Unknown command: {0}", command.Name);
+                result.Status = "Unknown";
+            }
+            return response;
+        }
+
+        private static void Finished(PendingCommand command, Event.CommandResult result)
+        {
+            bool removed;
+            activeIds.TryRemove(command.Id, out removed);
+            results.Enqueue(new FinishedCommand { Result = result, Depth = command.Depth });
+
+            if (Interlocked.Decrement(ref outstanding) == 0 || results.Count >= MAX_RESULTS_PER_POST)
+            {
+                FlushResults();
+            }
+        }
+
+        /// <summary>
+        /// Sends the results of the commands that have finished.  If the server can't be reached they're dropped, as the
+        /// commands have already run.
+        /// </summary>
+        private static void FlushResults()
+        {
+            try
+            {
+                lock (flushLock)
+                {
+                    while (!results.IsEmpty)
+                    {
+                        var batch = new List<Event.CommandResult>();
+                        int depth = 0;
+                        FinishedCommand finished;
+                        while (batch.Count < MAX_RESULTS_PER_POST && results.TryDequeue(out finished))
+                        {
+                            batch.Add(finished.Result);
+                            depth = Math.Max(depth, finished.Depth);
+                        }
+
+                        dynamic response;
+                        if (!Event.PostCommandResults(batch, out response))
+                        {
+                            Log.Warn("Unable to send the results of {0} commands", batch.Count);
+                            continue;
+                        }
+
+                        // Commands in reply to the results follow on from those commands, so they count towards the same limit
+                        Submit(response, depth + 1);
+                    }
+                }
+            }
+            catch (Exception e)
+            {
+                Log.Exception(e, "Exception sending command results");
+            }
+        }
+    }
+}
@@ -32,8 +32,15 @@ namespace srsvc
 
             [DataMember]
             internal string FileType = "";
+
+            // How the file data in the form is encoded
+            [DataMember]
+            internal string Compression = "";
         }
 
+        // Size of the reads from the file being uploaded
+        private const int UPLOAD_READ_SIZE = 64 * 1024;
+
         /// <summary>
         /// This function is wrapped by other calls in order to upload files
         /// </summary>
@@ -43,26 +50,32 @@ namespace srsvc
         /// <returns></returns>
         public static dynamic UploadFile(byte[] Sha256ByteArray, string FilePath, string type)
         {
+            // Only send the parts of the file the server doesn't already have, if it supports that
+            dynamic chunkedResponse;
+            if (UploadFileInChunks(Sha256ByteArray, FilePath, type, out chunkedResponse))
+            {
+                return chunkedResponse;
+            }
+
             UploadFilePost eventPost = new UploadFilePost();
             string sha256HexString = Helpers.ByteArrayToHexString(Sha256ByteArray);
             eventPost.Sha256 = sha256HexString;
             eventPost.FileType = type;
+            eventPost.Compression = "gzip";
 
             string postMessage = Helpers.SerializeToJson(eventPost, typeof(UploadFilePost));
 
-            // Read file data
-            // TODO Need to be smarter about avoiding reading the entire file into memory at once
-            FileStream fs = new FileStream(FilePath, FileMode.Open, FileAccess.Read, FileShare.Read);
-            byte[] data = new byte[fs.Length];
-            fs.Read(data, 0, data.Length);
-            fs.Close();
-
-            // Generate post objects
-            Dictionary<string, object> postParameters = new Dictionary<string, object>();
-            postParameters.Add("event_data", postMessage);
-            postParameters.Add("file", new Beacon.FileParameter(data, sha256HexString, "application/octet-stream"));
+            // The file is read, compressed and sent a piece at a time, so large files don't have to fit in memory
+            string response;
+            using (var fs = new FileStream(FilePath, FileMode.Open, FileAccess.Read, FileShare.Read, UPLOAD_READ_SIZE, FileOptions.SequentialScan))
+            {
+                // Generate post objects
+                Dictionary<string, object> postParameters = new Dictionary<string, object>();
+                postParameters.Add("event_data", postMessage);
+                postParameters.Add("file", new Beacon.FileParameter(fs, sha256HexString, "application/octet-stream") { Compress = true });
 
-            string response = Beacon.MultipartFormDataPost("/api/v1/UploadFile", postParameters);
+                response = Beacon.MultipartFormDataPost("/api/v1/UploadFile", postParameters);
+            }
 
             return Json.Decode(response);
         }
@@ -25,7 +25,8 @@ namespace srsvc
     public partial class Command
     {
         /// <summary>
-        /// Delay so we don't try contacting the server again for a while
+        /// Delay so we don't try contacting the server again for a while.  Only the beacon and command channel wait, so
+        /// commands that are already queued aren't held up.
         /// </summary>
         /// <param name="serverMsg"></param>
         /// <returns></returns>
@@ -41,7 +42,7 @@ namespace srsvc
                 Delay = 60 * 5;
             }
 
-            System.Threading.Thread.Sleep(Delay * 1000);
+            Beacon.Stall(TimeSpan.FromSeconds(Delay));
 
             return null;
         }
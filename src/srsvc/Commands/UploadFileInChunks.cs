@@ -0,0 +1,191 @@
+﻿////////////////////////////////////////////////////////////////////////////
+//
+// Summit Route End Point Protection
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+using System.IO;
+
+using System.Runtime.Serialization;
+using System.Runtime.Serialization.Json;
+
+using System.Web.Helpers;
+using Microsoft.CSharp.RuntimeBinder;
+
+namespace srsvc
+{
+    public partial class Command
+    {
+        [DataContract]
+        internal class UploadChunkInfo
+        {
+            [DataMember]
+            internal string Sha256 = "";
+
+            [DataMember]
+            internal int Length = 0;
+        }
+
+        [DataContract]
+        internal class UploadChunksPost : Event.EventPost
+        {
+            [DataMember]
+            internal string Sha256 = "";
+
+            [DataMember]
+            internal string FileType = "";
+
+            [DataMember]
+            internal long Size = 0;
+
+            // In the order they make up the file
+            [DataMember]
+            internal List<UploadChunkInfo> Chunks = new List<UploadChunkInfo>();
+        }
+
+        [DataContract]
+        internal class UploadChunkPost : Event.EventPost
+        {
+            // Hash of the whole file
+            [DataMember]
+            internal string Sha256 = "";
+
+            [DataMember]
+            internal string ChunkSha256 = "";
+
+            [DataMember]
+            internal long Offset = 0;
+
+            [DataMember]
+            internal string Compression = "";
+        }
+
+        // Times to try sending a chunk before giving up until the server asks for the file again
+        private const int MAX_CHUNK_ATTEMPTS = 3;
+
+        /// <summary>
+        /// Uploads the file as content defined chunks (see FileChunker), only sending the chunks the server doesn't
+        /// already have from other files or from an earlier attempt at this one that failed part way through.
+        ///
+        /// The server is first sent the list of chunks, and replies with the ones it's missing.  Each of those is sent,
+        /// and then the server is told to put the file together.
+        /// </summary>
+        /// <param name="sha256ByteArray"></param>
+        /// <param name="filePath"></param>
+        /// <param name="type"></param>
+        /// <param name="response">The server's response to the completed upload, or null if it failed</param>
+        /// <returns>False if the server doesn't support chunked uploads, so the file should be sent whole</returns>
+        public static bool UploadFileInChunks(byte[] sha256ByteArray, string filePath, string type, out dynamic response)
+        {
+            response = null;
+            string sha256HexString = Helpers.ByteArrayToHexString(sha256ByteArray);
+
+            using (var fs = new FileStream(filePath, FileMode.Open, FileAccess.Read, FileShare.Read, UPLOAD_READ_SIZE, FileOptions.SequentialScan))
+            {
+                var chunks = FileChunker.Split(fs);
+
+                // Ask which chunks the server needs
+                var chunksPost = new UploadChunksPost();
+                chunksPost.Sha256 = sha256HexString;
+                chunksPost.FileType = type;
+                chunksPost.Size = fs.Length;
+                foreach (var chunk in chunks)
+                {
+                    chunksPost.Chunks.Add(new UploadChunkInfo { Sha256 = Helpers.ByteArrayToHexString(chunk.Sha256), Length = chunk.Length });
+                }
+
+                string chunksResponse = Beacon.PostToServer(Helpers.SerializeToJson(chunksPost, typeof(UploadChunksPost)), "/api/v1/UploadChunks");
+                if (chunksResponse == "")
+                {
+                    return false;
+                }
+
+                var missing = new HashSet<string>(StringComparer.OrdinalIgnoreCase);
+                try
+                {
+                    dynamic missingMsg = Json.Decode(chunksResponse);
+                    foreach (string chunkSha256 in missingMsg.Missing)
+                    {
+                        missing.Add(chunkSha256);
+                    }
+                }
+                catch (Exception e)
+                {
+                    // Older servers reply without a list of missing chunks
+                    Log.Exception(e, "Server did not accept a chunked upload of {0}", filePath);
+                    return false;
+                }
+
+                int sent = 0;
+                long bytesSent = 0;
+                foreach (var chunk in chunks)
+                {
+                    string chunkSha256 = Helpers.ByteArrayToHexString(chunk.Sha256);
+                    if (!missing.Remove(chunkSha256))
+                    {
+                        continue;
+                    }
+
+                    if (!UploadChunk(fs, chunk, sha256HexString, chunkSha256))
+                    {
+                        // The server keeps the chunks it has, so the next attempt picks up from here
+                        Log.Error("Unable to upload {0}, sent {1} of {2} chunks", filePath, sent, chunks.Count);
+                        return true;
+                    }
+                    sent++;
+                    bytesSent += chunk.Length;
+                }
+                Log.Info("Sent {0} of {1} chunks ({2} of {3} bytes) of {4}", sent, chunks.Count, bytesSent, fs.Length, filePath);
+            }
+
+            // Tell the server it has all the chunks
+            UploadFilePost completePost = new UploadFilePost();
+            completePost.Sha256 = sha256HexString;
+            completePost.FileType = type;
+
+            string completeResponse = Beacon.PostToServer(Helpers.SerializeToJson(completePost, typeof(UploadFilePost)), "/api/v1/UploadChunksComplete");
+            if (completeResponse != "")
+            {
+                response = Json.Decode(completeResponse);
+            }
+            return true;
+        }
+
+        /// <summary>
+        /// Sends one chunk of the file, gzipped, retrying a few times
+        /// </summary>
+        /// <returns>True once the server has acknowledged it</returns>
+        private static bool UploadChunk(FileStream fs, FileChunker.Chunk chunk, string sha256HexString, string chunkSha256)
+        {
+            UploadChunkPost chunkPost = new UploadChunkPost();
+            chunkPost.Sha256 = sha256HexString;
+            chunkPost.ChunkSha256 = chunkSha256;
+            chunkPost.Offset = chunk.Offset;
+            chunkPost.Compression = "gzip";
+            string postMessage = Helpers.SerializeToJson(chunkPost, typeof(UploadChunkPost));
+
+            byte[] data = FileChunker.Read(fs, chunk);
+
+            for (int attempt = 1; attempt <= MAX_CHUNK_ATTEMPTS; attempt++)
+            {
+                Dictionary<string, object> postParameters = new Dictionary<string, object>();
+                postParameters.Add("event_data", postMessage);
+                postParameters.Add("file", new Beacon.FileParameter(new MemoryStream(data), chunkSha256, "application/octet-stream") { Compress = true });
+
+                if (Beacon.MultipartFormDataPost("/api/v1/UploadChunk", postParameters) != "")
+                {
+                    return true;
+                }
+                Log.Warn("Attempt {0} to upload chunk {1} failed", attempt, chunkSha256);
+            }
+            return false;
+        }
+    }
+}
@@ -41,14 +41,24 @@ namespace srsvc
             return SessionFactory;
         }
 
+        /// <summary>
+        /// Returns the path for a file kept alongside the DB, in the directory where this assembly is executing from
+        /// </summary>
+        /// <param name="fileName"></param>
+        /// <returns></returns>
+        public static string GetDataFilePath(string fileName)
+        {
+            Uri uri = new System.Uri(Assembly.GetExecutingAssembly().CodeBase);
+            return Path.Combine(Path.GetDirectoryName(Uri.UnescapeDataString(uri.AbsolutePath)), fileName);
+        }
+
         private static ISessionFactory CreateSessionFactory()
         {
             // Set the database file to srepp.db in the directory where this assembly is executing from
-            Uri uri = new System.Uri(Assembly.GetExecutingAssembly().CodeBase);
-            DbFile = Path.Combine(Path.GetDirectoryName(Uri.UnescapeDataString(uri.AbsolutePath)), DB_FILE_NAME);
+            DbFile = GetDataFilePath(DB_FILE_NAME);
             Log.Info("Using DB file: {0}", DbFile);
 
-            return Fluently.Configure()
+            var sessionFactory = Fluently.Configure()
                 .Database(SQLiteConfiguration.Standard
                     .UsingFile(DbFile))
                 .Mappings(m => m.FluentMappings.AddFromAssemblyOf<Executable>())
@@ -59,8 +69,50 @@ namespace srsvc
                 .Mappings(m => m.FluentMappings.AddFromAssemblyOf<ProcessEvent>())
                 .Mappings(m => m.FluentMappings.AddFromAssemblyOf<CatalogFile>())
 
-                .ExposeConfiguration(cfg => new SchemaUpdate(cfg).Execute(false, true))
+                .ExposeConfiguration(cfg =>
+                {
+                    cfg.SetProperty(NHibernate.Cfg.Environment.PrepareSql, "true");
+                    new SchemaUpdate(cfg).Execute(false, true);
+                })
                 .BuildSessionFactory();
+
+            CreateIndexes(sessionFactory);
+            return sessionFactory;
+        }
+
+        /// <summary>
+        /// Indexes for the lookups done while deciding on processes and answering the server.  SchemaUpdate only
+        /// creates indexes along with new tables, so DBs from older versions get them from here.  Indexes on mapped
+        /// columns are also declared, with the same names, in the mappings.
+        /// </summary>
+        private static readonly string[] INDEXES =
+        {
+            "CREATE INDEX IF NOT EXISTS IX_Executable_Path_LastWriteTime ON Executable (Path, LastWriteTime)",
+            "CREATE INDEX IF NOT EXISTS IX_Executable_Sha256 ON Executable (Sha256)",
+            "CREATE INDEX IF NOT EXISTS IX_Signer_Executable ON Signer (Executable_id)",
+            "CREATE INDEX IF NOT EXISTS IX_Certificate_SerialNumber_Issuer ON Certificate (SerialNumber, Issuer)",
+            "CREATE INDEX IF NOT EXISTS IX_CatalogFile_FilePath ON CatalogFile (FilePath)",
+            "CREATE INDEX IF NOT EXISTS IX_CatalogFile_Sha256 ON CatalogFile (Sha256)",
+            "CREATE INDEX IF NOT EXISTS IX_CatalogFile_HasInformedServer ON CatalogFile (HasInformedServer)",
+            "CREATE INDEX IF NOT EXISTS IX_ProcessEvent_HasInformedServer ON ProcessEvent (HasInformedServer)",
+        };
+
+        private static void CreateIndexes(ISessionFactory sessionFactory)
+        {
+            using (var session = sessionFactory.OpenSession())
+            {
+                foreach (var index in INDEXES)
+                {
+                    try
+                    {
+                        session.CreateSQLQuery(index).ExecuteUpdate();
+                    }
+                    catch (Exception e)
+                    {
+                        Log.Exception(e, "Unable to create index: {0}", index);
+                    }
+                }
+            }
         }
 
         public static void AddSignersToExe(Executable exe, List<Signer> signers)
@@ -99,42 +151,49 @@ namespace srsvc
 
                     session.Save(rule);
                     transaction.Commit();
+                    Arbiter.InvalidateRules();
                 }
             }
         }
 
         /// <summary>
-        /// Records process event info in the DB
+        /// Records process event info in the DB.  The event is queued and written by the EventWriter.
         /// </summary>
         /// <param name="processInfo"></param>
         /// <param name="ExecutableId"></param>
         /// <param name="state"></param>
-        public static void LogProcessEvent(SRSvc.PROCESS_INFO processInfo, long ExecutableId, ProcessState state)
+        /// <param name="decision"></param>
+        public static void LogProcessEvent(SRSvc.PROCESS_INFO processInfo, long ExecutableId, ProcessState state, Decision decision)
         {
-            Log.Info("Saving info for exe {0}", ExecutableId);
+            Log.Debug("Saving info for exe {0}", ExecutableId);
 
-            var sessionFactory = Database.getSessionFactory();
-            using (var session = sessionFactory.OpenSession())
+            EventWriter.Enqueue(new ProcessEvent
             {
-                using (var transaction = session.BeginTransaction())
-                {
-                    var processEvent = new ProcessEvent
-                    {
-                        ExecutableId = ExecutableId,
-                        Pid = processInfo.pid,
-                        Ppid = processInfo.ppid,
-                        CommandLine = processInfo.CommandLine,
-                        EventTime = DateTime.UtcNow,
-                        State = (uint)state
-                    };
-
-                    session.Save(processEvent);
-                    transaction.Commit();
-                }
-            }
+                ExecutableId = ExecutableId,
+                Pid = processInfo.pid,
+                Ppid = processInfo.ppid,
+                CommandLine = processInfo.CommandLine,
+                EventTime = DateTime.UtcNow,
+                State = (uint)state,
+                Denied = (decision == Decision.DENY)
+            });
         }
 
         public static void LogCatalogFile(string catalogFilePath)
+        {
+            LogCatalogFile(catalogFilePath, null, 0);
+        }
+
+        /// <summary>
+        /// Records the catalog, using the hash and size from the catalog index when we have them instead of rereading the file
+        /// </summary>
+        /// <param name="catalog"></param>
+        public static void LogCatalogFile(CatalogIndex.CatalogEntry catalog)
+        {
+            LogCatalogFile(catalog.Path, catalog.Sha256, catalog.Size);
+        }
+
+        private static void LogCatalogFile(string catalogFilePath, byte[] sha256Hash, long size)
         {
             Log.Info("Catalog file used: {0}", catalogFilePath);
 
@@ -153,14 +212,18 @@ namespace srsvc
                         Log.Info("Catalog file never seen before, so adding it to the DB");
 
                         // TODO I should not be keeping track of the catalogs by filename instead of using the hash
-                        byte[] md5Hash, sha1Hash, sha256Hash;
-                        Helpers.ComputeHashes(catalogFilePath, out md5Hash, out sha1Hash, out sha256Hash);
+                        if (sha256Hash == null)
+                        {
+                            byte[] md5Hash, sha1Hash;
+                            Helpers.ComputeHashes(catalogFilePath, out md5Hash, out sha1Hash, out sha256Hash);
+                            size = new System.IO.FileInfo(catalogFilePath).Length;
+                        }
 
                         var catalogFile = new CatalogFile
                         {
                             FilePath = catalogFilePath,
                             Sha256 = sha256Hash,
-                            Size = (int)(new System.IO.FileInfo(catalogFilePath).Length),
+                            Size = (int)size,
                             FirstAccessTime = DateTime.UtcNow
                         };
 
@@ -235,6 +298,11 @@ namespace srsvc
         public virtual byte[] Sha1 { get; set; }
         public virtual byte[] Sha256 { get; set; }
 
+        /// <summary>
+        /// Bytes, when it was hashed.  0 for executables recorded before this was.
+        /// </summary>
+        public virtual long Size { get; set; }
+
 
         public virtual IList<Signer> Signers { get; set; }
 
@@ -254,8 +322,8 @@ namespace srsvc
         public ExecutableMap()
         {
             Id(x => x.Id);
-            Map(x => x.Path);
-            Map(x => x.LastWriteTime);
+            Map(x => x.Path).Index("IX_Executable_Path_LastWriteTime");
+            Map(x => x.LastWriteTime).Index("IX_Executable_Path_LastWriteTime");
             Map(x => x.LastSeen);
             Map(x => x.FirstSeen);
             Map(x => x.LastChecked);
@@ -264,7 +332,8 @@ namespace srsvc
             Map(x => x.Blocked);
             Map(x => x.Md5);
             Map(x => x.Sha1);
-            Map(x => x.Sha256);
+            Map(x => x.Sha256).Index("IX_Executable_Sha256");
+            Map(x => x.Size).Default("0");
             HasMany(x => x.Signers)
                 .Cascade.All();
         }
@@ -312,8 +381,8 @@ namespace srsvc
         {
             Id(x => x.Id);
             Map(x => x.Version);
-            Map(x => x.Issuer);
-            Map(x => x.SerialNumber);
+            Map(x => x.Issuer).Index("IX_Certificate_SerialNumber_Issuer");
+            Map(x => x.SerialNumber).Index("IX_Certificate_SerialNumber_Issuer");
             Map(x => x.DigestAlgorithm);
             Map(x => x.DigestEncryptionAlgorithm);
         }
@@ -389,6 +458,7 @@ namespace srsvc
         public virtual string CommandLine { get; set; }
         public virtual DateTime EventTime { get; set; }
         public virtual uint State { get; set; } // 0 = Started before us, 1 = Started, 2 = Terminated
+        public virtual bool Denied { get; set; }  // Sent to the server ahead of allowed processes
         public virtual bool HasInformedServer { get; set; } 
     }
 
@@ -403,7 +473,8 @@ namespace srsvc
             Map(x => x.CommandLine);
             Map(x => x.EventTime);
             Map(x => x.State);
-            Map(x => x.HasInformedServer).Default("false");
+            Map(x => x.Denied).Default("false");
+            Map(x => x.HasInformedServer).Default("false").Index("IX_ProcessEvent_HasInformedServer");
         }
     }
 
@@ -423,11 +494,11 @@ namespace srsvc
         public CatalogFileMap()
         {
             Id(x => x.Id);
-            Map(x => x.FilePath);
-            Map(x => x.Sha256);
+            Map(x => x.FilePath).Index("IX_CatalogFile_FilePath");
+            Map(x => x.Sha256).Index("IX_CatalogFile_Sha256");
             Map(x => x.Size);
             Map(x => x.FirstAccessTime);
-            Map(x => x.HasInformedServer).Default("false");
+            Map(x => x.HasInformedServer).Default("false").Index("IX_CatalogFile_HasInformedServer");
         }
     }
 }
@@ -0,0 +1,113 @@
+﻿////////////////////////////////////////////////////////////////////////////
+//
+// Summit Route End Point Protection
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+using System.Threading;
+using System.Diagnostics;
+
+namespace srsvc
+{
+    /// <summary>
+    /// Stages of Arbiter.DecideOnProcess, in the order they run
+    /// </summary>
+    public enum DecisionStage { Identity = 0, Cache, Policy, Hash, Signature, Rules, Persist }
+
+    /// <summary>
+    /// Latency counters for each stage of deciding on a process, logged periodically
+    /// </summary>
+    public static class DecisionMetrics
+    {
+        // Log a summary every this many decisions
+        private const long SUMMARY_INTERVAL = 100;
+
+        private static readonly int StageCount = Enum.GetValues(typeof(DecisionStage)).Length;
+
+        private static long[] counts = new long[StageCount];
+        private static long[] totalTicks = new long[StageCount];
+        private static long[] maxTicks = new long[StageCount];
+
+        private static long decisions = 0;
+        private static long provisionalDecisions = 0;
+
+        /// <summary>
+        /// Times a stage, ex. using (DecisionMetrics.Time(DecisionStage.Hash, true)) { ... }
+        /// </summary>
+        /// <param name="stage"></param>
+        /// <param name="record">False to not time it, for decisions that aren't holding up a launch</param>
+        /// <returns>Null if not recording</returns>
+        public static IDisposable Time(DecisionStage stage, bool record)
+        {
+            return record ? new StageTimer(stage) : null;
+        }
+
+        private class StageTimer : IDisposable
+        {
+            private DecisionStage stage;
+            private Stopwatch stopwatch;
+
+            public StageTimer(DecisionStage stage)
+            {
+                this.stage = stage;
+                this.stopwatch = Stopwatch.StartNew();
+            }
+
+            public void Dispose()
+            {
+                Record(stage, stopwatch.ElapsedTicks);
+            }
+        }
+
+        public static void Record(DecisionStage stage, long elapsedTicks)
+        {
+            int i = (int)stage;
+            Interlocked.Increment(ref counts[i]);
+            Interlocked.Add(ref totalTicks[i], elapsedTicks);
+
+            long max;
+            while (elapsedTicks > (max = Interlocked.Read(ref maxTicks[i])))
+            {
+                if (Interlocked.CompareExchange(ref maxTicks[i], elapsedTicks, max) == max) break;
+            }
+        }
+
+        /// <summary>
+        /// Counts a finished decision, and whether we had to answer the driver before it was done
+        /// </summary>
+        /// <param name="provisional"></param>
+        public static void RecordDecision(bool provisional)
+        {
+            if (provisional)
+            {
+                Interlocked.Increment(ref provisionalDecisions);
+            }
+            if (Interlocked.Increment(ref decisions) % SUMMARY_INTERVAL == 0)
+            {
+                LogSummary();
+            }
+        }
+
+        public static void LogSummary()
+        {
+            Log.Info("Decisions: {0} ({1} provisional)", Interlocked.Read(ref decisions), Interlocked.Read(ref provisionalDecisions));
+            foreach (DecisionStage stage in Enum.GetValues(typeof(DecisionStage)))
+            {
+                int i = (int)stage;
+                long count = Interlocked.Read(ref counts[i]);
+                if (count == 0) continue;
+
+                double averageMs = Interlocked.Read(ref totalTicks[i]) * 1000.0 / Stopwatch.Frequency / count;
+                double maxMs = Interlocked.Read(ref maxTicks[i]) * 1000.0 / Stopwatch.Frequency;
+                Log.Info("  {0}: {1} runs, avg {2:F2}ms, max {3:F2}ms", stage, count, averageMs, maxMs);
+            }
+        }
+    }
+}
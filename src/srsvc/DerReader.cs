@@ -0,0 +1,217 @@
+﻿////////////////////////////////////////////////////////////////////////////
+//
+// Summit Route End Point Protection
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+using System.IO;
+
+namespace srsvc
+{
+    /// <summary>
+    /// Minimal reader for DER encoded ASN.1, enough to walk PKCS#7 structures such as catalogs and Authenticode signatures.
+    /// Each constructed element is read as a new DerReader over its contents.
+    /// </summary>
+    public class DerReader
+    {
+        public const byte TAG_INTEGER = 0x02;
+        public const byte TAG_BIT_STRING = 0x03;
+        public const byte TAG_OCTET_STRING = 0x04;
+        public const byte TAG_NULL = 0x05;
+        public const byte TAG_OID = 0x06;
+        public const byte TAG_UTC_TIME = 0x17;
+        public const byte TAG_GENERALIZED_TIME = 0x18;
+        public const byte TAG_SEQUENCE = 0x30;
+        public const byte TAG_SET = 0x31;
+        public const byte TAG_CONTEXT_0 = 0xa0;  // [0] constructed
+        public const byte TAG_CONTEXT_1 = 0xa1;  // [1] constructed
+
+        private byte[] data;
+        private int position;
+        private int end;
+
+        public DerReader(byte[] data) : this(data, 0, data.Length)
+        {
+        }
+
+        public DerReader(byte[] data, int offset, int length)
+        {
+            if (offset < 0 || length < 0 || offset + length > data.Length)
+            {
+                throw new InvalidDataException("DER element is past the end of the data");
+            }
+            this.data = data;
+            this.position = offset;
+            this.end = offset + length;
+        }
+
+        /// <summary>
+        /// True if there are more elements to read at this level
+        /// </summary>
+        public bool HasData
+        {
+            get { return position < end; }
+        }
+
+        /// <summary>
+        /// Tag of the next element, without reading it
+        /// </summary>
+        /// <returns></returns>
+        public byte PeekTag()
+        {
+            if (!HasData)
+            {
+                throw new InvalidDataException("Unexpected end of DER data");
+            }
+            return data[position];
+        }
+
+        /// <summary>
+        /// Reads the next element's header, returning where its contents are.  Leaves position after the element.
+        /// </summary>
+        /// <param name="tag"></param>
+        /// <param name="contentOffset"></param>
+        /// <param name="contentLength"></param>
+        private void ReadHeader(out byte tag, out int contentOffset, out int contentLength)
+        {
+            tag = PeekTag();
+            if ((tag & 0x1f) == 0x1f)
+            {
+                throw new InvalidDataException("High tag numbers are not supported");
+            }
+            int p = position + 1;
+            if (p >= end)
+            {
+                throw new InvalidDataException("Truncated DER length");
+            }
+
+            int length = data[p++];
+            if (length == 0x80)
+            {
+                throw new InvalidDataException("Indefinite lengths are not DER");
+            }
+            if (length > 0x80)
+            {
+                int lengthBytes = length & 0x7f;
+                if (lengthBytes > 4 || p + lengthBytes > end)
+                {
+                    throw new InvalidDataException("Bad DER length");
+                }
+                length = 0;
+                for (int i = 0; i < lengthBytes; i++)
+                {
+                    length = (length << 8) | data[p++];
+                }
+                if (length < 0)
+                {
+                    throw new InvalidDataException("Bad DER length");
+                }
+            }
+
+            if (length > end - p)
+            {
+                throw new InvalidDataException("DER element is past the end of its parent");
+            }
+
+            contentOffset = p;
+            contentLength = length;
+            position = p + length;
+        }
+
+        /// <summary>
+        /// Reads the next element and returns a reader over its contents
+        /// </summary>
+        /// <param name="expectedTag"></param>
+        /// <returns></returns>
+        public DerReader ReadConstructed(byte expectedTag)
+        {
+            byte tag;
+            int offset, length;
+            ReadHeader(out tag, out offset, out length);
+            if (tag != expectedTag)
+            {
+                throw new InvalidDataException(String.Format("Expected DER tag {0:x2} but found {1:x2}", expectedTag, tag));
+            }
+            return new DerReader(data, offset, length);
+        }
+
+        /// <summary>
+        /// Reads the next element, which must have the given tag, and returns a copy of its contents
+        /// </summary>
+        /// <param name="expectedTag"></param>
+        /// <returns></returns>
+        public byte[] ReadBytes(byte expectedTag)
+        {
+            byte tag;
+            int offset, length;
+            ReadHeader(out tag, out offset, out length);
+            if (tag != expectedTag)
+            {
+                throw new InvalidDataException(String.Format("Expected DER tag {0:x2} but found {1:x2}", expectedTag, tag));
+            }
+            byte[] value = new byte[length];
+            Array.Copy(data, offset, value, 0, length);
+            return value;
+        }
+
+        /// <summary>
+        /// Returns a copy of the whole next element, header included, for handing to something that wants the encoded form
+        /// </summary>
+        /// <returns></returns>
+        public byte[] ReadEncoded()
+        {
+            int start = position;
+            byte tag;
+            int offset, length;
+            ReadHeader(out tag, out offset, out length);
+            byte[] value = new byte[position - start];
+            Array.Copy(data, start, value, 0, value.Length);
+            return value;
+        }
+
+        /// <summary>
+        /// Skips over the next element
+        /// </summary>
+        public void Skip()
+        {
+            byte tag;
+            int offset, length;
+            ReadHeader(out tag, out offset, out length);
+        }
+
+        /// <summary>
+        /// Reads an OBJECT IDENTIFIER as a dotted string, ex. "1.3.6.1.4.1.311.2.1.4"
+        /// </summary>
+        /// <returns></returns>
+        public string ReadOid()
+        {
+            byte[] value = ReadBytes(TAG_OID);
+            if (value.Length == 0)
+            {
+                throw new InvalidDataException("Empty OID");
+            }
+
+            var oid = new StringBuilder();
+            oid.AppendFormat("{0}.{1}", value[0] / 40, value[0] % 40);
+
+            ulong component = 0;
+            for (int i = 1; i < value.Length; i++)
+            {
+                component = (component << 7) | (ulong)(value[i] & 0x7f);
+                if ((value[i] & 0x80) == 0)
+                {
+                    oid.Append('.').Append(component);
+                    component = 0;
+                }
+            }
+            return oid.ToString();
+        }
+    }
+}
@@ -0,0 +1,374 @@
+﻿////////////////////////////////////////////////////////////////////////////
+//
+// Summit Route End Point Protection
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+using System.IO;
+
+namespace srsvc
+{
+    /// <summary>
+    /// Compact binary encoding for batches of process events sent to the server.  Most launches are of a few hundred
+    /// executables, so each executable's path, hashes and size are sent once per batch and events refer to them by ID, as
+    /// do repeated command lines.
+    ///
+    /// Layout:
+    ///   "SREV", version byte
+    ///   string SystemUUID, string CustomerUUID, varint CurrentClientTime
+    ///   entries, each starting with a tag byte:
+    ///     TAG_STRING       string                              Defines the next string ID
+    ///     TAG_EXECUTABLE   varint path string ID, bytes Md5, bytes Sha1, bytes Sha256, varint size, byte signed
+    ///                                                          Defines the next executable ID
+    ///     TAG_EVENT        varint executable ID, zigzag varint seconds since the previous event, varint type,
+    ///                      varint pid, varint ppid, varint command line string ID
+    ///     TAG_END
+    /// Strings and bytes are a varint length followed by the data (UTF-8 for strings).  Varints are 7 bits per byte,
+    /// least significant first, with the high bit set on all but the last byte.  Times are unix times in seconds.
+    /// </summary>
+    public static class EventEncoding
+    {
+        public const string CONTENT_TYPE = "application/x-srepp-events";
+
+        public static readonly byte[] MAGIC = Encoding.ASCII.GetBytes("SREV");
+        public const byte VERSION = 1;
+
+        public const byte TAG_END = 0;
+        public const byte TAG_STRING = 1;
+        public const byte TAG_EXECUTABLE = 2;
+        public const byte TAG_EVENT = 3;
+
+        // Sanity limit on strings and byte arrays when decoding
+        private const int MAX_LENGTH = 1024 * 1024;
+
+        public static void WriteVarint(Stream stream, ulong value)
+        {
+            while (value >= 0x80)
+            {
+                stream.WriteByte((byte)(value | 0x80));
+                value >>= 7;
+            }
+            stream.WriteByte((byte)value);
+        }
+
+        public static ulong ReadVarint(Stream stream)
+        {
+            ulong value = 0;
+            for (int shift = 0; shift < 64; shift += 7)
+            {
+                int b = stream.ReadByte();
+                if (b < 0)
+                {
+                    throw new EndOfStreamException();
+                }
+                value |= (ulong)(b & 0x7F) << shift;
+                if ((b & 0x80) == 0)
+                {
+                    return value;
+                }
+            }
+            throw new InvalidDataException("Varint is too long");
+        }
+
+        /// <summary>
+        /// Maps signed values to unsigned ones so small negative numbers stay small: 0, -1, 1, -2, 2 ... => 0, 1, 2, 3, 4 ...
+        /// </summary>
+        public static ulong ZigZag(long value)
+        {
+            return (ulong)((value << 1) ^ (value >> 63));
+        }
+
+        public static long UnZigZag(ulong value)
+        {
+            return (long)(value >> 1) ^ -(long)(value & 1);
+        }
+
+        public static void WriteBytes(Stream stream, byte[] data)
+        {
+            data = data ?? new byte[0];
+            WriteVarint(stream, (ulong)data.Length);
+            stream.Write(data, 0, data.Length);
+        }
+
+        public static byte[] ReadBytes(Stream stream)
+        {
+            ulong length = ReadVarint(stream);
+            if (length > MAX_LENGTH)
+            {
+                throw new InvalidDataException("Length is too large");
+            }
+
+            var data = new byte[length];
+            int read = 0;
+            while (read < data.Length)
+            {
+                int count = stream.Read(data, read, data.Length - read);
+                if (count <= 0)
+                {
+                    throw new EndOfStreamException();
+                }
+                read += count;
+            }
+            return data;
+        }
+
+        public static void WriteString(Stream stream, string value)
+        {
+            WriteBytes(stream, Encoding.UTF8.GetBytes(value ?? ""));
+        }
+
+        public static string ReadString(Stream stream)
+        {
+            return Encoding.UTF8.GetString(ReadBytes(stream));
+        }
+    }
+
+    /// <summary>
+    /// Writes a batch of process events to a stream in the EventEncoding format.  Call Finish once all the events have been
+    /// written.
+    /// </summary>
+    public class EventEncoder
+    {
+        private Stream stream;
+        private StringTable strings = new StringTable();
+        private Dictionary<long, int> executableIds = new Dictionary<long, int>();  // DB ID => ID in this batch
+        private long previousTime = 0;
+
+        public int EventCount { get; private set; }
+
+        public EventEncoder(Stream stream, string systemUUID, string customerUUID, DateTime clientTime)
+        {
+            this.stream = stream;
+
+            stream.Write(EventEncoding.MAGIC, 0, EventEncoding.MAGIC.Length);
+            stream.WriteByte(EventEncoding.VERSION);
+            EventEncoding.WriteString(stream, systemUUID);
+            EventEncoding.WriteString(stream, customerUUID);
+            EventEncoding.WriteVarint(stream, (ulong)Helpers.ConvertToUnixTime(clientTime));
+        }
+
+        public void Write(ProcessEvent processEvent, Executable executable)
+        {
+            int executableId = GetExecutableId(executable);
+            int commandLineId = GetStringId(processEvent.CommandLine ?? "");
+
+            long time = Helpers.ConvertToUnixTime(processEvent.EventTime);
+
+            stream.WriteByte(EventEncoding.TAG_EVENT);
+            EventEncoding.WriteVarint(stream, (ulong)executableId);
+            EventEncoding.WriteVarint(stream, EventEncoding.ZigZag(time - previousTime));
+            EventEncoding.WriteVarint(stream, processEvent.State);
+            EventEncoding.WriteVarint(stream, processEvent.Pid);
+            EventEncoding.WriteVarint(stream, processEvent.Ppid);
+            EventEncoding.WriteVarint(stream, (ulong)commandLineId);
+
+            previousTime = time;
+            EventCount++;
+        }
+
+        public void Finish()
+        {
+            stream.WriteByte(EventEncoding.TAG_END);
+            stream.Flush();
+        }
+
+        /// <summary>
+        /// Returns the string's ID in this batch, writing it out the first time it's seen
+        /// </summary>
+        private int GetStringId(string value)
+        {
+            bool added;
+            int id = strings.GetOrAdd(value, out added);
+            if (added)
+            {
+                stream.WriteByte(EventEncoding.TAG_STRING);
+                EventEncoding.WriteString(stream, value);
+            }
+            return id;
+        }
+
+        /// <summary>
+        /// Returns the executable's ID in this batch, writing it out the first time it's seen
+        /// </summary>
+        private int GetExecutableId(Executable executable)
+        {
+            int id;
+            if (executableIds.TryGetValue(executable.Id, out id))
+            {
+                return id;
+            }
+
+            int pathId = GetStringId(executable.Path ?? "");
+
+            long size = executable.Size;
+            if (size == 0)
+            {
+                // Recorded before we kept the size
+                try
+                {
+                    size = new FileInfo(executable.Path).Length;
+                }
+                catch (Exception)
+                {
+                    // The file may have been deleted since it ran, which shouldn't keep the event from being sent
+                }
+            }
+
+            stream.WriteByte(EventEncoding.TAG_EXECUTABLE);
+            EventEncoding.WriteVarint(stream, (ulong)pathId);
+            EventEncoding.WriteBytes(stream, executable.Md5);
+            EventEncoding.WriteBytes(stream, executable.Sha1);
+            EventEncoding.WriteBytes(stream, executable.Sha256);
+            EventEncoding.WriteVarint(stream, (ulong)size);
+            stream.WriteByte((byte)(executable.Signed ? 1 : 0));
+
+            id = executableIds.Count;
+            executableIds[executable.Id] = id;
+            return id;
+        }
+    }
+
+    /// <summary>
+    /// Reads a batch of process events written by EventEncoder, one event at a time
+    /// </summary>
+    public class EventDecoder
+    {
+        public class DecodedEvent
+        {
+            public long TimeOfEvent;
+            public uint Type;
+            public uint Pid;
+            public uint Ppid;
+            public string Path;
+            public string CommandLine;
+            public byte[] Md5;
+            public byte[] Sha1;
+            public byte[] Sha256;
+            public long Size;
+            public bool IsSigned;
+        }
+
+        private class DecodedExecutable
+        {
+            public string Path;
+            public byte[] Md5;
+            public byte[] Sha1;
+            public byte[] Sha256;
+            public long Size;
+            public bool IsSigned;
+        }
+
+        private Stream stream;
+        private StringTable strings = new StringTable();
+        private List<DecodedExecutable> executables = new List<DecodedExecutable>();
+        private long previousTime = 0;
+        private bool finished = false;
+
+        public string SystemUUID { get; private set; }
+        public string CustomerUUID { get; private set; }
+        public long CurrentClientTime { get; private set; }
+
+        public EventDecoder(Stream stream)
+        {
+            this.stream = stream;
+
+            var magic = new byte[EventEncoding.MAGIC.Length];
+            if (stream.Read(magic, 0, magic.Length) != magic.Length || !magic.SequenceEqual(EventEncoding.MAGIC))
+            {
+                throw new InvalidDataException("Not an event batch");
+            }
+            if (stream.ReadByte() != EventEncoding.VERSION)
+            {
+                throw new InvalidDataException("Unsupported event batch version");
+            }
+
+            SystemUUID = EventEncoding.ReadString(stream);
+            CustomerUUID = EventEncoding.ReadString(stream);
+            CurrentClientTime = (long)EventEncoding.ReadVarint(stream);
+        }
+
+        /// <summary>
+        /// Returns the next event, or null at the end of the batch
+        /// </summary>
+        /// <returns></returns>
+        public DecodedEvent Read()
+        {
+            while (!finished)
+            {
+                int tag = stream.ReadByte();
+                switch (tag)
+                {
+                    case EventEncoding.TAG_END:
+                        finished = true;
+                        break;
+
+                    case EventEncoding.TAG_STRING:
+                        bool added;
+                        strings.GetOrAdd(EventEncoding.ReadString(stream), out added);
+                        break;
+
+                    case EventEncoding.TAG_EXECUTABLE:
+                        executables.Add(new DecodedExecutable
+                        {
+                            Path = GetString(EventEncoding.ReadVarint(stream)),
+                            Md5 = EventEncoding.ReadBytes(stream),
+                            Sha1 = EventEncoding.ReadBytes(stream),
+                            Sha256 = EventEncoding.ReadBytes(stream),
+                            Size = (long)EventEncoding.ReadVarint(stream),
+                            IsSigned = (stream.ReadByte() == 1)
+                        });
+                        break;
+
+                    case EventEncoding.TAG_EVENT:
+                        ulong executableId = EventEncoding.ReadVarint(stream);
+                        if (executableId >= (ulong)executables.Count)
+                        {
+                            throw new InvalidDataException("Event refers to an unknown executable");
+                        }
+                        var executable = executables[(int)executableId];
+
+                        previousTime += EventEncoding.UnZigZag(EventEncoding.ReadVarint(stream));
+                        var decoded = new DecodedEvent
+                        {
+                            TimeOfEvent = previousTime,
+                            Type = (uint)EventEncoding.ReadVarint(stream),
+                            Pid = (uint)EventEncoding.ReadVarint(stream),
+                            Ppid = (uint)EventEncoding.ReadVarint(stream),
+                            Path = executable.Path,
+                            Md5 = executable.Md5,
+                            Sha1 = executable.Sha1,
+                            Sha256 = executable.Sha256,
+                            Size = executable.Size,
+                            IsSigned = executable.IsSigned
+                        };
+                        decoded.CommandLine = GetString(EventEncoding.ReadVarint(stream));
+                        return decoded;
+
+                    case -1:
+                        throw new EndOfStreamException();
+
+                    default:
+                        throw new InvalidDataException(String.Format("Unknown tag {0} in event batch", tag));
+                }
+            }
+            return null;
+        }
+
+        private string GetString(ulong id)
+        {
+            string value;
+            if (id > int.MaxValue || !strings.TryGetString((int)id, out value))
+            {
+                throw new InvalidDataException("Reference to an unknown string");
+            }
+            return value;
+        }
+    }
+}
@@ -0,0 +1,690 @@
+﻿////////////////////////////////////////////////////////////////////////////
+//
+// Summit Route End Point Protection
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+using System.IO;
+using System.IO.MemoryMappedFiles;
+using System.Globalization;
+using System.Threading;
+
+namespace srsvc
+{
+    /// <summary>
+    /// Append-only journal of process events waiting to be sent to the server, kept out of the DB so recording an event
+    /// is a copy into a mapped view and sending one is a cursor move, instead of an insert and then an update.
+    ///
+    /// The journal is a directory of fixed size, memory mapped segment files, each named for the offset of its first
+    /// byte.  Offsets only ever increase.  Each record is framed as:
+    ///   int32 length, uint32 CRC32 of the payload, payload
+    /// A length of 0 marks the end of the records in a segment.  Command lines are stored once per segment, in a string
+    /// record ahead of the first event that uses them, and events refer to them by ID.
+    ///
+    /// The offset of the next record to send is saved in the cursor file.  Segments are deleted once the cursor has
+    /// passed them, or when the journal gets too large or old, in which case unsent events are dropped and counted.
+    ///
+    /// Denied processes go to their own journal, which is sent first, so they aren't held up behind a backlog of allowed
+    /// ones after the server has been unreachable, and aren't dropped to make room for them.
+    /// </summary>
+    public class EventJournal
+    {
+        private const string SEGMENT_EXTENSION = ".seg";
+        private const string CURSOR_FILE_NAME = "cursor";
+
+        private const long SEGMENT_SIZE = 4 * 1024 * 1024;
+        private const long MIN_JOURNAL_SIZE = 2 * SEGMENT_SIZE;
+
+        private const int HEADER_SIZE = 8;  // Length, CRC
+        private const int MAX_RECORD_SIZE = 128 * 1024;  // Enough for the longest command line Windows allows
+
+        // Type of record, the first byte of the payload
+        private const byte RECORD_PROCESS_EVENT = 1;  // Command line inline, written by older versions
+        private const byte RECORD_STRING = 2;  // ID, string
+        private const byte RECORD_PROCESS_EVENT_INTERNED = 3;  // Command line ID
+
+        // Windows' limit, which also keeps any record well under MAX_RECORD_SIZE
+        private const int MAX_COMMAND_LINE_LENGTH = 32767;
+
+        /// <summary>
+        /// A record read back from the journal
+        /// </summary>
+        public class Record
+        {
+            public long Offset;
+            public long NextOffset;  // Offset to acknowledge once this record has been sent
+            public ProcessEvent ProcessEvent;  // Null for record types this version doesn't know
+        }
+
+        /// <summary>
+        /// Denied processes
+        /// </summary>
+        public static readonly EventJournal Priority = new EventJournal("journal-priority", true);
+
+        /// <summary>
+        /// Allowed processes
+        /// </summary>
+        public static readonly EventJournal Normal = new EventJournal("journal", false);
+
+        /// <summary>
+        /// In the order they're sent
+        /// </summary>
+        public static readonly EventJournal[] All = { Priority, Normal };
+
+        private object journalLock = new object();
+
+        private string name;
+        private bool denied;  // Whether the events in this journal are for denied processes
+        private long maxSize = MIN_JOURNAL_SIZE;
+        private TimeSpan maxAge = TimeSpan.MaxValue;
+
+        private string journalDirectory = null;
+        private List<long> segments = new List<long>();  // Base offsets, ascending
+
+        // The segment being written, always the last one
+        private MemoryMappedFile currentFile = null;
+        private MemoryMappedViewAccessor currentView = null;
+        private long currentBase = 0;
+        private long writePosition = 0;
+        private StringTable writeStrings = new StringTable();  // Strings written to the current segment
+
+        // Strings from the segment being read, and how far into it they've been read
+        private StringTable readStrings = new StringTable();
+        private long readStringsBase = -1;
+        private long readStringsPosition = 0;
+
+        private long cursor = 0;
+
+        // Unsent events deleted to stay within the limits
+        private long droppedForSize = 0;
+        private long droppedForAge = 0;
+
+        private EventJournal(string name, bool denied)
+        {
+            this.name = name;
+            this.denied = denied;
+        }
+
+        public bool IsOpen
+        {
+            get { return currentView != null; }
+        }
+
+        public long DroppedForSize
+        {
+            get { return Interlocked.Read(ref droppedForSize); }
+        }
+
+        public long DroppedForAge
+        {
+            get { return Interlocked.Read(ref droppedForAge); }
+        }
+
+        public override string ToString()
+        {
+            return name;
+        }
+
+        /// <summary>
+        /// Opens the journal, creating it if needed, and finds the end of the last segment
+        /// </summary>
+        /// <param name="maxSize">Bytes the segments may take, beyond which the oldest are deleted even if unsent</param>
+        /// <param name="maxAge">How long events are kept before they're deleted even if unsent</param>
+        public void Open(long maxSize, TimeSpan maxAge)
+        {
+            lock (journalLock)
+            {
+                if (IsOpen) return;
+
+                this.maxSize = Math.Max(maxSize, MIN_JOURNAL_SIZE);
+                this.maxAge = maxAge;
+
+                journalDirectory = Database.GetDataFilePath(name);
+                Directory.CreateDirectory(journalDirectory);
+
+                segments.Clear();
+                foreach (var file in Directory.GetFiles(journalDirectory, "*" + SEGMENT_EXTENSION))
+                {
+                    long segmentBase;
+                    if (long.TryParse(Path.GetFileNameWithoutExtension(file), NumberStyles.AllowHexSpecifier, CultureInfo.InvariantCulture, out segmentBase))
+                    {
+                        segments.Add(segmentBase);
+                    }
+                }
+                segments.Sort();
+
+                cursor = ReadCursor();
+
+                if (segments.Count == 0)
+                {
+                    // Carry on from the cursor, so offsets keep increasing even when everything was deleted
+                    OpenSegment(cursor);
+                    segments.Add(cursor);
+                }
+                else
+                {
+                    OpenSegment(segments.Last());
+                    writePosition = RecoverWritePosition();
+                }
+
+                Log.Info("Opened event journal {0}: {1} segments, cursor {2:x}, end {3:x}", name, segments.Count, cursor, currentBase + writePosition);
+            }
+        }
+
+        public void Close()
+        {
+            lock (journalLock)
+            {
+                CloseSegment();
+            }
+        }
+
+        /// <summary>
+        /// Appends the events to the journal and flushes them to the file
+        /// </summary>
+        /// <param name="processEvents"></param>
+        public void Append(IEnumerable<ProcessEvent> processEvents)
+        {
+            lock (journalLock)
+            {
+                if (!IsOpen)
+                {
+                    throw new InvalidOperationException(String.Format("Event journal {0} is not open", name));
+                }
+
+                foreach (var processEvent in processEvents)
+                {
+                    string commandLine = processEvent.CommandLine ?? "";
+                    if (commandLine.Length > MAX_COMMAND_LINE_LENGTH)
+                    {
+                        commandLine = commandLine.Substring(0, MAX_COMMAND_LINE_LENGTH);
+                    }
+
+                    while (true)
+                    {
+                        bool added;
+                        int commandLineId = writeStrings.GetOrAdd(commandLine, out added);
+                        byte[] stringPayload = added ? EncodeString(commandLineId, commandLine) : null;
+                        byte[] eventPayload = Encode(processEvent, commandLineId);
+
+                        // The string has to be in the same segment as the event
+                        long needed = HEADER_SIZE + eventPayload.Length + (added ? HEADER_SIZE + stringPayload.Length : 0);
+                        if (writePosition + needed > SEGMENT_SIZE && writePosition != 0)
+                        {
+                            Rotate();
+                            continue;
+                        }
+
+                        if (added)
+                        {
+                            WriteRecord(stringPayload);
+                        }
+                        WriteRecord(eventPayload);
+                        break;
+                    }
+                }
+
+                currentView.Flush();
+            }
+        }
+
+        /// <summary>
+        /// Returns up to maxRecords records, starting at the cursor
+        /// </summary>
+        /// <param name="maxRecords"></param>
+        /// <returns></returns>
+        public List<Record> Read(int maxRecords)
+        {
+            var records = new List<Record>();
+            lock (journalLock)
+            {
+                if (!IsOpen) return records;
+
+                foreach (var segmentBase in segments)
+                {
+                    if (records.Count >= maxRecords) break;
+                    if (segmentBase + SEGMENT_SIZE <= cursor) continue;
+
+                    long position = Math.Max(cursor - segmentBase, 0);
+                    if (segmentBase == currentBase)
+                    {
+                        ReadSegment(currentView, segmentBase, position, writePosition, maxRecords, records);
+                        continue;
+                    }
+
+                    try
+                    {
+                        using (var file = MemoryMappedFile.CreateFromFile(SegmentPath(segmentBase), FileMode.Open, null, 0, MemoryMappedFileAccess.Read))
+                        using (var view = file.CreateViewAccessor(0, 0, MemoryMappedFileAccess.Read))
+                        {
+                            ReadSegment(view, segmentBase, position, SEGMENT_SIZE, maxRecords, records);
+                        }
+                    }
+                    catch (IOException e)
+                    {
+                        Log.Exception(e, "Unable to read {0} segment {1:x}", name, segmentBase);
+                    }
+                }
+            }
+            return records;
+        }
+
+        /// <summary>
+        /// Moves the cursor past records that have been sent, and deletes segments that are no longer needed
+        /// </summary>
+        /// <param name="nextOffset">Record.NextOffset of the last record sent</param>
+        public void Acknowledge(long nextOffset)
+        {
+            lock (journalLock)
+            {
+                if (nextOffset <= cursor) return;
+
+                cursor = nextOffset;
+                WriteCursor();
+                DeleteOldSegments();
+            }
+        }
+
+        private void WriteRecord(byte[] payload)
+        {
+            // Length goes last, so a record is never seen before the rest of it has been written
+            currentView.WriteArray(writePosition + HEADER_SIZE, payload, 0, payload.Length);
+            currentView.Write(writePosition + 4, Crc32(payload));
+            currentView.Write(writePosition, payload.Length);
+            writePosition += HEADER_SIZE + payload.Length;
+        }
+
+        private string SegmentPath(long segmentBase)
+        {
+            return Path.Combine(journalDirectory, segmentBase.ToString("x16") + SEGMENT_EXTENSION);
+        }
+
+        private void OpenSegment(long segmentBase)
+        {
+            currentBase = segmentBase;
+            writePosition = 0;
+            writeStrings.Clear();
+            currentFile = MemoryMappedFile.CreateFromFile(SegmentPath(segmentBase), FileMode.OpenOrCreate, null, SEGMENT_SIZE, MemoryMappedFileAccess.ReadWrite);
+            currentView = currentFile.CreateViewAccessor(0, SEGMENT_SIZE);
+        }
+
+        private void CloseSegment()
+        {
+            if (currentView != null)
+            {
+                currentView.Flush();
+                currentView.Dispose();
+                currentView = null;
+            }
+            if (currentFile != null)
+            {
+                currentFile.Dispose();
+                currentFile = null;
+            }
+        }
+
+        /// <summary>
+        /// Starts a new segment after the current one
+        /// </summary>
+        private void Rotate()
+        {
+            long nextBase = currentBase + SEGMENT_SIZE;
+            CloseSegment();
+            OpenSegment(nextBase);
+            segments.Add(nextBase);
+
+            DeleteOldSegments();
+        }
+
+        /// <summary>
+        /// Deletes segments that have been sent, then any beyond the size and age limits
+        /// </summary>
+        private void DeleteOldSegments()
+        {
+            while (segments.Count > 1)
+            {
+                long oldest = segments[0];
+                bool sent = (oldest + SEGMENT_SIZE <= cursor);
+                bool tooLarge = (segments.Count * SEGMENT_SIZE > maxSize);
+
+                // Everything in a segment was written before the next one was created
+                bool tooOld = (DateTime.UtcNow - File.GetCreationTimeUtc(SegmentPath(segments[1])) > maxAge);
+
+                if (!sent && !tooLarge && !tooOld) break;
+
+                long dropped = sent ? 0 : CountEvents(oldest, Math.Max(cursor - oldest, 0));
+                try
+                {
+                    File.Delete(SegmentPath(oldest));
+                }
+                catch (IOException e)
+                {
+                    Log.Exception(e, "Unable to delete {0} segment {1:x}", name, oldest);
+                    break;
+                }
+                segments.RemoveAt(0);
+
+                if (!sent)
+                {
+                    if (tooLarge)
+                    {
+                        Interlocked.Add(ref droppedForSize, dropped);
+                    }
+                    else
+                    {
+                        Interlocked.Add(ref droppedForAge, dropped);
+                    }
+                    Log.Warn("Dropped {0} unsent process events from {1} segment {2:x} for being too {3}, {4} dropped for size and {5} for age in all",
+                        dropped, name, oldest, tooLarge ? "large" : "old", DroppedForSize, DroppedForAge);
+                }
+            }
+        }
+
+        /// <summary>
+        /// Counts the process events in a segment from the position on, for reporting how many were dropped
+        /// </summary>
+        private long CountEvents(long segmentBase, long position)
+        {
+            long count = 0;
+            try
+            {
+                using (var file = MemoryMappedFile.CreateFromFile(SegmentPath(segmentBase), FileMode.Open, null, 0, MemoryMappedFileAccess.Read))
+                using (var view = file.CreateViewAccessor(0, 0, MemoryMappedFileAccess.Read))
+                {
+                    byte[] payload;
+                    while (position + HEADER_SIZE <= SEGMENT_SIZE && (payload = ReadPayload(view, position, SEGMENT_SIZE)) != null)
+                    {
+                        if (payload[0] != RECORD_STRING)
+                        {
+                            count++;
+                        }
+                        position += HEADER_SIZE + payload.Length;
+                    }
+                }
+            }
+            catch (IOException e)
+            {
+                Log.Exception(e, "Unable to count the events in {0} segment {1:x}", name, segmentBase);
+            }
+            return count;
+        }
+
+        /// <summary>
+        /// Reads records from a segment into the list, stopping at the end of the records or a record that's corrupt
+        /// </summary>
+        private void ReadSegment(MemoryMappedViewAccessor view, long segmentBase, long position, long limit, int maxRecords, List<Record> records)
+        {
+            // Events can refer to strings from anywhere earlier in the segment, so read from wherever we haven't seen yet
+            if (readStringsBase != segmentBase)
+            {
+                readStrings.Clear();
+                readStringsBase = segmentBase;
+                readStringsPosition = 0;
+            }
+            long start = position;
+            position = Math.Min(position, readStringsPosition);
+
+            while (records.Count < maxRecords && position + HEADER_SIZE <= limit)
+            {
+                byte[] payload = ReadPayload(view, position, limit);
+                if (payload == null)
+                {
+                    if (view.ReadInt32(position) != 0)
+                    {
+                        Log.Error("Corrupt record in {0} segment {1:x} at {2:x}, skipping the rest of the segment", name, segmentBase, position);
+                    }
+                    break;
+                }
+
+                long nextPosition = position + HEADER_SIZE + payload.Length;
+                if (payload[0] == RECORD_STRING)
+                {
+                    AddString(readStrings, payload);
+                }
+                else if (position >= start)
+                {
+                    records.Add(new Record
+                    {
+                        Offset = segmentBase + position,
+                        NextOffset = segmentBase + nextPosition,
+                        ProcessEvent = Decode(payload, readStrings, denied)
+                    });
+                }
+                position = nextPosition;
+                readStringsPosition = Math.Max(readStringsPosition, position);
+            }
+        }
+
+        /// <summary>
+        /// Returns the payload of the record at the position, or null if there isn't a valid one there
+        /// </summary>
+        private static byte[] ReadPayload(MemoryMappedViewAccessor view, long position, long limit)
+        {
+            int length = view.ReadInt32(position);
+            if (length <= 0 || length > MAX_RECORD_SIZE || position + HEADER_SIZE + length > limit)
+            {
+                return null;
+            }
+
+            var payload = new byte[length];
+            view.ReadArray(position + HEADER_SIZE, payload, 0, length);
+            if (view.ReadUInt32(position + 4) != Crc32(payload))
+            {
+                return null;
+            }
+            return payload;
+        }
+
+        /// <summary>
+        /// Finds the end of the valid records in the current segment.  Anything after it is left over from a write that
+        /// didn't finish, so it's cleared to keep it from being mistaken for records later.
+        /// </summary>
+        /// <returns></returns>
+        private long RecoverWritePosition()
+        {
+            long position = 0;
+            byte[] payload;
+            while (position + HEADER_SIZE <= SEGMENT_SIZE && (payload = ReadPayload(currentView, position, SEGMENT_SIZE)) != null)
+            {
+                if (payload[0] == RECORD_STRING)
+                {
+                    AddString(writeStrings, payload);
+                }
+                position += HEADER_SIZE + payload.Length;
+            }
+
+            if (position + HEADER_SIZE <= SEGMENT_SIZE && currentView.ReadInt32(position) != 0)
+            {
+                Log.Warn("Discarding incomplete record in {0} segment {1:x} at {2:x}", name, currentBase, position);
+                var zeros = new byte[64 * 1024];
+                for (long i = position; i < SEGMENT_SIZE; i += zeros.Length)
+                {
+                    currentView.WriteArray(i, zeros, 0, (int)Math.Min(zeros.Length, SEGMENT_SIZE - i));
+                }
+                currentView.Flush();
+            }
+            return position;
+        }
+
+        private static byte[] Encode(ProcessEvent processEvent, int commandLineId)
+        {
+            using (var stream = new MemoryStream())
+            using (var writer = new BinaryWriter(stream, Encoding.UTF8))
+            {
+                writer.Write(RECORD_PROCESS_EVENT_INTERNED);
+                writer.Write(processEvent.ExecutableId);
+                writer.Write(processEvent.Pid);
+                writer.Write(processEvent.Ppid);
+                writer.Write(processEvent.EventTime.ToBinary());
+                writer.Write(processEvent.State);
+                writer.Write(commandLineId);
+                writer.Flush();
+                return stream.ToArray();
+            }
+        }
+
+        private static byte[] EncodeString(int id, string value)
+        {
+            using (var stream = new MemoryStream())
+            using (var writer = new BinaryWriter(stream, Encoding.UTF8))
+            {
+                writer.Write(RECORD_STRING);
+                writer.Write(id);
+                writer.Write(value);
+                writer.Flush();
+                return stream.ToArray();
+            }
+        }
+
+        /// <summary>
+        /// Adds the string from a string record to the table, which gives it the same ID it was written with as long as
+        /// the segment's string records are added in order
+        /// </summary>
+        private static void AddString(StringTable strings, byte[] payload)
+        {
+            using (var reader = new BinaryReader(new MemoryStream(payload), Encoding.UTF8))
+            {
+                reader.ReadByte();
+                int id = reader.ReadInt32();
+                bool added;
+                if (strings.GetOrAdd(reader.ReadString(), out added) != id)
+                {
+                    Log.Error("Journal string {0} is out of order", id);
+                }
+            }
+        }
+
+        private static ProcessEvent Decode(byte[] payload, StringTable strings, bool denied)
+        {
+            using (var reader = new BinaryReader(new MemoryStream(payload), Encoding.UTF8))
+            {
+                byte type = reader.ReadByte();
+                if (type != RECORD_PROCESS_EVENT && type != RECORD_PROCESS_EVENT_INTERNED)
+                {
+                    return null;
+                }
+
+                var processEvent = new ProcessEvent
+                {
+                    ExecutableId = reader.ReadInt64(),
+                    Pid = reader.ReadUInt32(),
+                    Ppid = reader.ReadUInt32(),
+                    EventTime = DateTime.FromBinary(reader.ReadInt64()),
+                    State = reader.ReadUInt32(),
+                    Denied = denied
+                };
+
+                if (type == RECORD_PROCESS_EVENT)
+                {
+                    processEvent.CommandLine = reader.ReadString();
+                }
+                else
+                {
+                    int commandLineId = reader.ReadInt32();
+                    string commandLine;
+                    if (!strings.TryGetString(commandLineId, out commandLine))
+                    {
+                        Log.Error("Journaled process event refers to unknown string {0}", commandLineId);
+                        return null;
+                    }
+                    processEvent.CommandLine = commandLine;
+                }
+                return processEvent;
+            }
+        }
+
+        /// <summary>
+        /// Reads the cursor file, which holds the offset and its CRC32.  If it's missing or corrupt we start from the
+        /// beginning of the journal, as sending events twice is better than not sending them.
+        /// </summary>
+        /// <returns></returns>
+        private long ReadCursor()
+        {
+            string path = Path.Combine(journalDirectory, CURSOR_FILE_NAME);
+            try
+            {
+                if (File.Exists(path))
+                {
+                    byte[] data = File.ReadAllBytes(path);
+                    if (data.Length == 12 && BitConverter.ToUInt32(data, 8) == Crc32(data, 0, 8))
+                    {
+                        return BitConverter.ToInt64(data, 0);
+                    }
+                    Log.Error("Cursor of {0} is corrupt, resending all its events", name);
+                }
+            }
+            catch (IOException e)
+            {
+                Log.Exception(e, "Unable to read the cursor of {0}", name);
+            }
+            return (segments.Count != 0) ? segments[0] : 0;
+        }
+
+        /// <summary>
+        /// Writes the cursor to a temporary file and then replaces the cursor file with it, so a crash leaves either the
+        /// old cursor or the new one
+        /// </summary>
+        private void WriteCursor()
+        {
+            string path = Path.Combine(journalDirectory, CURSOR_FILE_NAME);
+            string tempPath = path + ".tmp";
+
+            var data = new byte[12];
+            BitConverter.GetBytes(cursor).CopyTo(data, 0);
+            BitConverter.GetBytes(Crc32(data, 0, 8)).CopyTo(data, 8);
+
+            using (var stream = new FileStream(tempPath, FileMode.Create, FileAccess.Write, FileShare.None, data.Length, FileOptions.WriteThrough))
+            {
+                stream.Write(data, 0, data.Length);
+            }
+
+            if (File.Exists(path))
+            {
+                File.Replace(tempPath, path, null);
+            }
+            else
+            {
+                File.Move(tempPath, path);
+            }
+        }
+
+        private static readonly uint[] crcTable = CreateCrcTable();
+
+        private static uint[] CreateCrcTable()
+        {
+            var table = new uint[256];
+            for (uint i = 0; i < table.Length; i++)
+            {
+                uint crc = i;
+                for (int bit = 0; bit < 8; bit++)
+                {
+                    crc = ((crc & 1) != 0) ? (crc >> 1) ^ 0xEDB88320 : (crc >> 1);
+                }
+                table[i] = crc;
+            }
+            return table;
+        }
+
+        private static uint Crc32(byte[] data)
+        {
+            return Crc32(data, 0, data.Length);
+        }
+
+        private static uint Crc32(byte[] data, int offset, int count)
+        {
+            uint crc = 0xFFFFFFFF;
+            for (int i = offset; i < offset + count; i++)
+            {
+                crc = crcTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+            }
+            return ~crc;
+        }
+    }
+}
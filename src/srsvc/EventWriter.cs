@@ -0,0 +1,228 @@
+﻿////////////////////////////////////////////////////////////////////////////
+//
+// Summit Route End Point Protection
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+using System;
+using System.Collections.Generic;
+using System.Collections.Concurrent;
+using System.Linq;
+using System.Text;
+using System.Threading;
+using System.Diagnostics;
+
+namespace srsvc
+{
+    /// <summary>
+    /// Writes process events to the EventJournals from one thread, many to a flush, so a process starting costs a queue
+    /// insert instead of a write of its own.  Denied processes go to the priority journal.  If a journal can't be used,
+    /// its events go to the DB, many to a transaction.
+    ///
+    /// A batch is written once it has MAX_BATCH_SIZE events, or MAX_BATCH_DELAY after its first event arrived.
+    /// The queue is bounded: when it's full, callers wait for the writer to catch up, up to a point.
+    /// </summary>
+    public static class EventWriter
+    {
+        private const int MAX_BATCH_SIZE = 256;
+        private static readonly TimeSpan MAX_BATCH_DELAY = TimeSpan.FromMilliseconds(500);
+
+        private const int MAX_QUEUED_EVENTS = 10000;
+
+        // How long a caller will wait for space in the queue before the event is dropped
+        private static readonly TimeSpan ENQUEUE_TIMEOUT = TimeSpan.FromSeconds(5);
+
+        // How long Stop waits for the queue to be written out
+        private static readonly TimeSpan FLUSH_TIMEOUT = TimeSpan.FromSeconds(30);
+
+        private static BlockingCollection<ProcessEvent> queue = null;
+        private static Thread writerThread = null;
+
+        private static long eventsWritten = 0;
+        private static long batchesWritten = 0;
+        private static long eventsDropped = 0;
+
+        public static void Start()
+        {
+            if (writerThread != null) return;
+
+            // The priority journal gets a quarter of the space, as denied processes should be rare
+            long spoolSize = (long)SRSvc.conf.SpoolMaxSize * 1024 * 1024;
+            long prioritySize = spoolSize / 4;
+            TimeSpan maxAge = TimeSpan.FromDays(SRSvc.conf.SpoolMaxAge);
+            OpenJournal(EventJournal.Priority, prioritySize, maxAge);
+            OpenJournal(EventJournal.Normal, spoolSize - prioritySize, maxAge);
+
+            queue = new BlockingCollection<ProcessEvent>(new ConcurrentQueue<ProcessEvent>(), MAX_QUEUED_EVENTS);
+            writerThread = new Thread(new ThreadStart(WriteLoop));
+            writerThread.Name = "EventWriterThread";
+            writerThread.IsBackground = true;
+            writerThread.Start();
+        }
+
+        /// <summary>
+        /// Writes out everything that's queued, then stops the writer
+        /// </summary>
+        public static void Stop()
+        {
+            if (writerThread == null) return;
+
+            queue.CompleteAdding();
+            bool finished = writerThread.Join(FLUSH_TIMEOUT);
+            writerThread = null;
+
+            Log.Info("Event writer: {0} events in {1} batches, {2} dropped", eventsWritten, batchesWritten, eventsDropped);
+            if (!finished)
+            {
+                // The writer may still be appending, so the journals are left open for the process exit to clean up
+                Log.Error("Timed out writing {0} queued events, leaving the event journals open", queue.Count);
+                return;
+            }
+
+            foreach (var journal in EventJournal.All)
+            {
+                journal.Close();
+                Log.Info("Event journal {0}: {1} events dropped for size, {2} for age", journal, journal.DroppedForSize, journal.DroppedForAge);
+            }
+        }
+
+        private static void OpenJournal(EventJournal journal, long maxSize, TimeSpan maxAge)
+        {
+            try
+            {
+                journal.Open(maxSize, maxAge);
+            }
+            catch (Exception e)
+            {
+                Log.Exception(e, "Unable to open event journal {0}, its process events will be written to the DB", journal);
+            }
+        }
+
+        /// <summary>
+        /// Queues an event to be written
+        /// </summary>
+        /// <param name="processEvent"></param>
+        public static void Enqueue(ProcessEvent processEvent)
+        {
+            if (writerThread == null)
+            {
+                // Not started (or already stopped), so write it ourselves
+                WriteBatch(new List<ProcessEvent> { processEvent });
+                return;
+            }
+
+            try
+            {
+                if (!queue.TryAdd(processEvent, ENQUEUE_TIMEOUT))
+                {
+                    Interlocked.Increment(ref eventsDropped);
+                    Log.Error("Event queue is full, dropping process event for exe {0}", processEvent.ExecutableId);
+                }
+            }
+            catch (InvalidOperationException)
+            {
+                // Stopping
+                WriteBatch(new List<ProcessEvent> { processEvent });
+            }
+        }
+
+        private static void WriteLoop()
+        {
+            var batch = new List<ProcessEvent>(MAX_BATCH_SIZE);
+            while (!queue.IsCompleted)
+            {
+                try
+                {
+                    ProcessEvent processEvent;
+                    if (!queue.TryTake(out processEvent, Timeout.Infinite))
+                    {
+                        // Adding was completed and the queue is empty
+                        break;
+                    }
+                    batch.Add(processEvent);
+
+                    // Gather up whatever else arrives before the batch is due
+                    var stopwatch = Stopwatch.StartNew();
+                    while (batch.Count < MAX_BATCH_SIZE)
+                    {
+                        int remaining = (int)(MAX_BATCH_DELAY - stopwatch.Elapsed).TotalMilliseconds;
+                        if (remaining <= 0 || !queue.TryTake(out processEvent, remaining))
+                        {
+                            break;
+                        }
+                        batch.Add(processEvent);
+                    }
+
+                    WriteBatch(batch);
+                }
+                catch (Exception e)
+                {
+                    Log.Exception(e, "Exception writing {0} process events", batch.Count);
+                }
+                batch.Clear();
+            }
+        }
+
+        /// <summary>
+        /// Appends the events to their journals, or failing that inserts them in the DB
+        /// </summary>
+        /// <param name="batch"></param>
+        private static void WriteBatch(List<ProcessEvent> batch)
+        {
+            var denied = batch.Where(e => e.Denied).ToList();
+            if (denied.Count != 0)
+            {
+                WriteBatch(EventJournal.Priority, denied);
+            }
+            if (denied.Count != batch.Count)
+            {
+                WriteBatch(EventJournal.Normal, batch.Where(e => !e.Denied).ToList());
+            }
+
+            Interlocked.Add(ref eventsWritten, batch.Count);
+            Interlocked.Increment(ref batchesWritten);
+            Log.Debug("Wrote {0} process events", batch.Count);
+        }
+
+        private static void WriteBatch(EventJournal journal, List<ProcessEvent> batch)
+        {
+            if (journal.IsOpen)
+            {
+                try
+                {
+                    journal.Append(batch);
+                    return;
+                }
+                catch (Exception e)
+                {
+                    // Some of the batch may have made it into the journal, so those will be sent twice
+                    Log.Exception(e, "Unable to journal {0} process events in {1}, writing them to the DB", batch.Count, journal);
+                }
+            }
+            WriteToDatabase(batch);
+        }
+
+        /// <summary>
+        /// Inserts the events in one transaction
+        /// </summary>
+        /// <param name="batch"></param>
+        private static void WriteToDatabase(List<ProcessEvent> batch)
+        {
+            var sessionFactory = Database.getSessionFactory();
+            using (var session = sessionFactory.OpenStatelessSession())
+            {
+                using (var transaction = session.BeginTransaction())
+                {
+                    foreach (var processEvent in batch)
+                    {
+                        session.Insert(processEvent);
+                    }
+                    transaction.Commit();
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,60 @@
+﻿////////////////////////////////////////////////////////////////////////////
+//
+// Summit Route End Point Protection
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+
+using System.Runtime.Serialization;
+using System.Runtime.Serialization.Json;
+
+using System.Web.Helpers;
+
+
+namespace srsvc
+{
+    partial class Event
+    {
+        [DataContract]
+        internal class CommandPollPost : EventPost
+        {
+            // Seconds the server may wait for a command before replying
+            [DataMember]
+            internal int Wait = 0;
+        }
+
+        /// <summary>
+        /// Asks the server for a command, which it holds open for up to waitSeconds until it has one
+        /// </summary>
+        /// <param name="waitSeconds"></param>
+        /// <param name="command">The command, or null if there was none</param>
+        /// <returns>False if the server could not be reached</returns>
+        public static bool PollForCommand(int waitSeconds, out dynamic command)
+        {
+            command = null;
+
+            CommandPollPost eventPost = new CommandPollPost();
+            eventPost.Wait = waitSeconds;
+
+            string postMessage = Helpers.SerializeToJson(eventPost, typeof(CommandPollPost));
+            byte[] response = Beacon.LongPoll(postMessage, "/api/v1/Commands", waitSeconds);
+            if (response == null)
+            {
+                return false;
+            }
+
+            if (response.Length != 0)
+            {
+                command = Json.Decode(Encoding.UTF8.GetString(response));
+            }
+            return true;
+        }
+    }
+}
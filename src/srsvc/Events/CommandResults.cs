@@ -0,0 +1,81 @@
+﻿////////////////////////////////////////////////////////////////////////////
+//
+// Summit Route End Point Protection
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+
+using System.Runtime.Serialization;
+using System.Runtime.Serialization.Json;
+
+using System.Web.Helpers;
+
+
+namespace srsvc
+{
+    partial class Event
+    {
+        [DataContract]
+        internal class CommandResult
+        {
+            // From the command, or made up here if the server didn't give it one
+            [DataMember]
+            internal string CommandId = "";
+
+            [DataMember]
+            internal string Command = "";
+
+            // Succeeded, Failed, Unknown (not a command we have), or Dropped (too many queued)
+            [DataMember]
+            internal string Status = "";
+
+            [DataMember]
+            internal string Error = "";
+
+            [DataMember]
+            internal long DurationMs = 0;
+        }
+
+        [DataContract]
+        internal class CommandResultsPost : EventPost
+        {
+            // In the order the commands finished
+            [DataMember]
+            internal List<CommandResult> Results = new List<CommandResult>();
+        }
+
+        /// <summary>
+        /// Tells the server how a batch of commands went
+        /// </summary>
+        /// <param name="results"></param>
+        /// <param name="response">The server's response, which may be more commands</param>
+        /// <returns>False if the server could not be reached</returns>
+        public static bool PostCommandResults(List<CommandResult> results, out dynamic response)
+        {
+            response = null;
+
+            CommandResultsPost eventPost = new CommandResultsPost();
+            eventPost.Results = results;
+
+            string postMessage = Helpers.SerializeToJson(eventPost, typeof(CommandResultsPost));
+            byte[] responseData = Beacon.PostForm(Encoding.UTF8.GetBytes(postMessage), "/api/v1/CommandResults");
+            if (responseData == null)
+            {
+                return false;
+            }
+
+            if (responseData.Length != 0)
+            {
+                response = Json.Decode(Encoding.UTF8.GetString(responseData));
+            }
+            return true;
+        }
+    }
+}
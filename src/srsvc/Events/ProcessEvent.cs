@@ -11,90 +11,47 @@ using System;
 using System.Collections.Generic;
 using System.Linq;
 using System.Text;
-using System.Runtime.Serialization;
+using System.IO;
 
 namespace srsvc
 {
     partial class Event
     {
         /// <summary>
-        /// Data sent to the server when a new process is created
+        /// Rough upper bound on the encoded size of a process event, used to limit the size of batches
         /// </summary>
-        [DataContract]
-        internal class ProcessEventPost : EventPost
-        {
-            [DataMember]
-            internal Int64 TimeOfEvent = 0;
-
-            [DataMember]
-            internal Int32 Type = 0;
-
-            [DataMember]
-            internal Int64 PID = 0;
-
-            [DataMember]
-            internal Int64 PPID = 0;
-
-            [DataMember]
-            internal string Path = "";
-
-            [DataMember]
-            internal string CommandLine = "";
-
-            [DataMember]
-            internal string Md5 = "";
-
-            [DataMember]
-            internal string Sha1 = "";
-
-            [DataMember]
-            internal string Sha256 = "";
-
-            [DataMember]
-            internal Int32 Size = 0;
-
-            [DataMember]
-            internal bool IsSigned = false;
-        }
-
-        /// <summary>
-        /// Response after sending a process event
-        /// </summary>
-        [DataContract]
-        internal class ProcessEventResponse
+        /// <param name="processEvent"></param>
+        /// <param name="executable"></param>
+        /// <returns></returns>
+        public static int EstimateProcessEventSize(ProcessEvent processEvent, Executable executable)
         {
-            // nop
+            // Fixed fields and hashes, plus the strings at up to 3 bytes per character in UTF-8.  Executables and repeated
+            // command lines are only sent once per batch, so this is usually well over.
+            return 128 + 3 * ((executable.Path ?? "").Length + (processEvent.CommandLine ?? "").Length);
         }
 
-
         /// <summary>
-        /// Sends info about a process event to the server, returns true on having successful informed the server
+        /// Sends info about many process events to the server in one request, in the binary EventEncoding format.
+        /// Returns true on having successfully informed the server of all of them.
         /// </summary>
-        /// <param name="processEvent"></param>
+        /// <param name="processEvents"></param>
         /// <returns></returns>
-        public static bool PostProcessEvent(ProcessEvent processEvent, Executable executable)
+        public static bool PostProcessEvents(IList<KeyValuePair<ProcessEvent, Executable>> processEvents)
         {
-            ProcessEventPost processEventPost = new ProcessEventPost();
-            processEventPost.TimeOfEvent = Helpers.ConvertToUnixTime(processEvent.EventTime);
-            processEventPost.Type = (Int32)processEvent.State;
-            processEventPost.PID = processEvent.Pid;
-            processEventPost.PPID = processEvent.Ppid;
-            processEventPost.Path = executable.Path;
-            processEventPost.CommandLine = processEvent.CommandLine;
-            processEventPost.Md5 = Helpers.ByteArrayToHexString(executable.Md5);
-            processEventPost.Sha1 = Helpers.ByteArrayToHexString(executable.Sha1);
-            processEventPost.Sha256 = Helpers.ByteArrayToHexString(executable.Sha256);
-            processEventPost.Size = (int)(new System.IO.FileInfo(executable.Path).Length);
-            processEventPost.IsSigned = executable.Signed;
+            var postData = new MemoryStream();
+            var encoder = new EventEncoder(postData, SRSvc.conf.SystemUUID, SRSvc.conf.GroupUUID, DateTime.UtcNow);
+            foreach (var processEvent in processEvents)
+            {
+                encoder.Write(processEvent.Key, processEvent.Value);
+            }
+            encoder.Finish();
 
-            string postMessage = Helpers.SerializeToJson(processEventPost, typeof(ProcessEventPost));
-            string response = Beacon.PostToServer(postMessage, "/api/v1/ProcessEvent");
-            if (response == "")
+            byte[] response = Beacon.PostForm(postData.ToArray(), "/api/v1/ProcessEvents", EventEncoding.CONTENT_TYPE);
+            if (response == null)
             {
                 // Remote server could not be reached or encountered an error
                 return false;
             }
-            ProcessEventResponse processEventResponse = (ProcessEventResponse)Helpers.DeserializeFromJson(response, typeof(ProcessEventResponse));
 
             return true;
         }
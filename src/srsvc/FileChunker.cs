@@ -0,0 +1,155 @@
+﻿////////////////////////////////////////////////////////////////////////////
+//
+// Summit Route End Point Protection
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+using System.IO;
+using System.Security.Cryptography;
+
+namespace srsvc
+{
+    /// <summary>
+    /// Splits files into chunks at boundaries picked by their content (a rolling "gear" hash of the last 64 bytes), rather
+    /// than at fixed offsets.  An edit to a file only changes the chunks around it, so a new version of a binary mostly
+    /// has the same chunks as the old one and the server only needs to be sent the ones it doesn't already have.
+    ///
+    /// The boundaries have to be the same on every system and version of this service for that to work, so the gear table
+    /// and sizes below must not change.
+    /// </summary>
+    public static class FileChunker
+    {
+        public const int MIN_CHUNK_SIZE = 256 * 1024;
+        public const int MAX_CHUNK_SIZE = 4 * 1024 * 1024;
+
+        // A boundary is where the top 20 bits of the hash are zero, so chunks average about 1MB past the minimum.  The low
+        // bits only depend on the last few bytes, which makes for poor boundaries in padding and other repetitive data.
+        private const ulong BOUNDARY_MASK = ((1UL << 20) - 1) << 44;
+
+        // The hash is shifted left each byte, so only the last 64 bytes affect it, and only the top bits depend on all of them
+        private const int WINDOW_SIZE = 64;
+
+        private const int READ_SIZE = 64 * 1024;
+
+        public class Chunk
+        {
+            public long Offset;
+            public int Length;
+            public byte[] Sha256;
+        }
+
+        private static readonly ulong[] GEAR = CreateGearTable();
+
+        /// <summary>
+        /// Fills the gear table with SplitMix64 from a fixed seed, rather than System.Random, whose sequence isn't
+        /// guaranteed to stay the same between .NET versions
+        /// </summary>
+        /// <returns></returns>
+        private static ulong[] CreateGearTable()
+        {
+            var table = new ulong[256];
+            ulong state = 0x5352455050434443;  // "SREPPCDC"
+            for (int i = 0; i < table.Length; i++)
+            {
+                state += 0x9E3779B97F4A7C15;
+                ulong z = state;
+                z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+                z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+                table[i] = z ^ (z >> 31);
+            }
+            return table;
+        }
+
+        /// <summary>
+        /// Reads the stream to the end, returning its chunks in order
+        /// </summary>
+        /// <param name="stream"></param>
+        /// <returns></returns>
+        public static List<Chunk> Split(Stream stream)
+        {
+            var chunks = new List<Chunk>();
+            var buffer = new byte[READ_SIZE];
+
+            using (var sha256 = SHA256.Create())
+            {
+                long chunkOffset = 0;
+                int chunkLength = 0;
+                ulong hash = 0;
+
+                int read;
+                while ((read = stream.Read(buffer, 0, buffer.Length)) > 0)
+                {
+                    int hashedTo = 0;
+                    for (int i = 0; i < read; i++)
+                    {
+                        chunkLength++;
+
+                        // Nothing before the last window of the minimum size can affect whether there's a boundary there
+                        if (chunkLength < MIN_CHUNK_SIZE - WINDOW_SIZE)
+                        {
+                            continue;
+                        }
+
+                        hash = (hash << 1) + GEAR[buffer[i]];
+                        if ((chunkLength >= MIN_CHUNK_SIZE && (hash & BOUNDARY_MASK) == 0) || chunkLength >= MAX_CHUNK_SIZE)
+                        {
+                            sha256.TransformBlock(buffer, hashedTo, i + 1 - hashedTo, null, 0);
+                            hashedTo = i + 1;
+                            chunks.Add(EndChunk(sha256, chunkOffset, chunkLength));
+
+                            chunkOffset += chunkLength;
+                            chunkLength = 0;
+                            hash = 0;
+                        }
+                    }
+                    sha256.TransformBlock(buffer, hashedTo, read - hashedTo, null, 0);
+                }
+
+                if (chunkLength != 0)
+                {
+                    chunks.Add(EndChunk(sha256, chunkOffset, chunkLength));
+                }
+            }
+
+            return chunks;
+        }
+
+        private static Chunk EndChunk(SHA256 sha256, long offset, int length)
+        {
+            // This also resets the hash for the next chunk
+            sha256.TransformFinalBlock(new byte[0], 0, 0);
+            return new Chunk { Offset = offset, Length = length, Sha256 = sha256.Hash };
+        }
+
+        /// <summary>
+        /// Reads the chunk back from the stream
+        /// </summary>
+        /// <param name="stream"></param>
+        /// <param name="chunk"></param>
+        /// <returns></returns>
+        public static byte[] Read(Stream stream, Chunk chunk)
+        {
+            var data = new byte[chunk.Length];
+            stream.Seek(chunk.Offset, SeekOrigin.Begin);
+
+            int read = 0;
+            while (read < data.Length)
+            {
+                int count = stream.Read(data, read, data.Length - read);
+                if (count <= 0)
+                {
+                    throw new EndOfStreamException("File is shorter than when it was split into chunks");
+                }
+                read += count;
+            }
+            return data;
+        }
+    }
+}
@@ -0,0 +1,246 @@
+﻿////////////////////////////////////////////////////////////////////////////
+//
+// Summit Route End Point Protection
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+using System;
+using System.Collections.Generic;
+using System.Collections.Concurrent;
+using System.Linq;
+using System.Text;
+using System.IO;
+using System.Threading;
+using System.Threading.Tasks;
+using System.Security.Cryptography;
+
+namespace srsvc
+{
+    /// <summary>
+    /// Hashes a file with several digests at once.  For large files, one thread reads while one worker per digest hashes,
+    /// so the time taken is roughly the slower of the disk and the slowest digest, instead of their sum.
+    ///
+    /// Blocks move from the reader to every worker through bounded queues, and are handed back to the reader
+    /// once the last worker is done with them, so memory use is fixed at BLOCKS_IN_FLIGHT buffers per file.
+    /// </summary>
+    public static class HashPipeline
+    {
+        /// <summary>
+        /// Number of read buffers per file.  The reader can get this far ahead of the slowest digest.
+        /// </summary>
+        private const int BLOCKS_IN_FLIGHT = 4;
+
+        /// <summary>
+        /// Files smaller than this are hashed on the calling thread, as starting workers would cost more than it saves.
+        /// </summary>
+        private const long PIPELINE_THRESHOLD = 4 * Helpers.HASH_READ_BUFFER_SIZE;
+
+        /// <summary>
+        /// Read buffers returned by finished pipelines, so hashing lots of files doesn't keep allocating on the large object heap
+        /// </summary>
+        private static ConcurrentBag<byte[]> spareBuffers = new ConcurrentBag<byte[]>();
+
+        [ThreadStatic]
+        private static byte[] inlineBuffer;
+
+        private class Block
+        {
+            public byte[] Data;
+            public int Length;
+            public int Pending;  // Number of workers that still need to hash this block
+        }
+
+        /// <summary>
+        /// Reads the file once and feeds every block to each of the given algorithms, then finalizes them.
+        /// Results are read from each algorithm's Hash property.
+        /// </summary>
+        /// <param name="filePath"></param>
+        /// <param name="algorithms"></param>
+        public static void Compute(string filePath, params HashAlgorithm[] algorithms)
+        {
+            using (var input = Helpers.OpenForSequentialRead(filePath))
+            {
+                Compute(input, algorithms);
+            }
+        }
+
+        /// <summary>
+        /// Same as above, for a stream that's already open.  Hashing starts from the current position.
+        /// </summary>
+        /// <param name="input"></param>
+        /// <param name="algorithms"></param>
+        public static void Compute(Stream input, params HashAlgorithm[] algorithms)
+        {
+            if (input.Length - input.Position < PIPELINE_THRESHOLD || algorithms.Length < 2 || Environment.ProcessorCount < 2)
+            {
+                ComputeInline(input, algorithms);
+            }
+            else
+            {
+                ComputePipelined(input, algorithms);
+            }
+        }
+
+        /// <summary>
+        /// Single threaded: read a block, hash it with each algorithm, repeat
+        /// </summary>
+        /// <param name="input"></param>
+        /// <param name="algorithms"></param>
+        private static void ComputeInline(Stream input, HashAlgorithm[] algorithms)
+        {
+            if (inlineBuffer == null)
+            {
+                inlineBuffer = new byte[Helpers.HASH_READ_BUFFER_SIZE];
+            }
+            byte[] buffer = inlineBuffer;
+
+            int bytesRead;
+            while ((bytesRead = input.Read(buffer, 0, buffer.Length)) > 0)
+            {
+                foreach (var algorithm in algorithms)
+                {
+                    algorithm.TransformBlock(buffer, 0, bytesRead, buffer, 0);
+                }
+            }
+            // We have to call TransformFinalBlock, but we don't have any
+            // more data - just provide 0 bytes.
+            foreach (var algorithm in algorithms)
+            {
+                algorithm.TransformFinalBlock(buffer, 0, 0);
+            }
+        }
+
+        /// <summary>
+        /// Reader on the calling thread, one worker task per algorithm
+        /// </summary>
+        /// <param name="input"></param>
+        /// <param name="algorithms"></param>
+        private static void ComputePipelined(Stream input, HashAlgorithm[] algorithms)
+        {
+            var cancel = new CancellationTokenSource();
+            var freeBlocks = new BlockingCollection<Block>(BLOCKS_IN_FLIGHT);
+            var queues = new BlockingCollection<Block>[algorithms.Length];
+            var workers = new Task[algorithms.Length];
+            var blocks = new List<Block>();
+
+            for (int i = 0; i < BLOCKS_IN_FLIGHT; i++)
+            {
+                byte[] data;
+                if (!spareBuffers.TryTake(out data))
+                {
+                    data = new byte[Helpers.HASH_READ_BUFFER_SIZE];
+                }
+                var block = new Block { Data = data };
+                blocks.Add(block);
+                freeBlocks.Add(block);
+            }
+
+            try
+            {
+                for (int i = 0; i < algorithms.Length; i++)
+                {
+                    var queue = new BlockingCollection<Block>(BLOCKS_IN_FLIGHT);
+                    var algorithm = algorithms[i];
+                    queues[i] = queue;
+
+                    // Workers block on their queues, so give them their own threads rather than tying up the thread pool
+                    workers[i] = Task.Factory.StartNew(() =>
+                    {
+                        try
+                        {
+                            foreach (var block in queue.GetConsumingEnumerable(cancel.Token))
+                            {
+                                algorithm.TransformBlock(block.Data, 0, block.Length, block.Data, 0);
+                                if (Interlocked.Decrement(ref block.Pending) == 0)
+                                {
+                                    freeBlocks.Add(block);
+                                }
+                            }
+                            algorithm.TransformFinalBlock(new byte[0], 0, 0);
+                        }
+                        catch (Exception)
+                        {
+                            // Stop the reader and the other workers, this is rethrown from Task.WaitAll
+                            cancel.Cancel();
+                            throw;
+                        }
+                    }, cancel.Token, TaskCreationOptions.LongRunning, TaskScheduler.Default);
+                }
+
+                Exception readError = null;
+                try
+                {
+                    while (true)
+                    {
+                        Block block = freeBlocks.Take(cancel.Token);
+                        block.Length = input.Read(block.Data, 0, block.Data.Length);
+                        if (block.Length <= 0)
+                        {
+                            break;
+                        }
+
+                        block.Pending = algorithms.Length;
+                        foreach (var queue in queues)
+                        {
+                            queue.Add(block, cancel.Token);
+                        }
+                    }
+                }
+                catch (OperationCanceledException)
+                {
+                    // A worker failed, its exception is surfaced below
+                }
+                catch (Exception e)
+                {
+                    readError = e;
+                    cancel.Cancel();
+                }
+
+                foreach (var queue in queues)
+                {
+                    queue.CompleteAdding();
+                }
+
+                // Always wait for the workers, so no one is still using the buffers when they are handed back
+                try
+                {
+                    Task.WaitAll(workers);
+                }
+                catch (AggregateException e)
+                {
+                    if (readError == null)
+                    {
+                        // Report the worker's own exception, rather than the cancellations it caused in the others
+                        // Wrapped, so its stack trace is kept as the inner exception
+                        var cause = e.Flatten().InnerExceptions.FirstOrDefault(x => !(x is OperationCanceledException));
+                        if (cause != null) throw new CryptographicException("Hashing failed: " + cause.Message, cause);
+                        throw;
+                    }
+                }
+
+                if (readError != null)
+                {
+                    throw readError;
+                }
+            }
+            finally
+            {
+                cancel.Cancel();
+
+                // Workers are always waited on above, unless starting them failed, and one still running may use it
+                if (workers.All(w => w == null || w.IsCompleted))
+                {
+                    cancel.Dispose();
+                }
+
+                foreach (var block in blocks)
+                {
+                    spareBuffers.Add(block.Data);
+                }
+            }
+        }
+    }
+}
@@ -19,6 +19,51 @@ using System.Security.Cryptography;
 
 namespace srsvc
 {
+    /// <summary>
+    /// Everything we hash a file for, from one read of it (see Helpers.ComputeFileHashes)
+    /// </summary>
+    public class FileHashes
+    {
+        public byte[] Md5 { get; set; }
+        public byte[] Sha1 { get; set; }
+        public byte[] Sha256 { get; set; }
+        public long Size { get; set; }
+
+        /// <summary>
+        /// Authenticode image hashes, null if this is not a PE file
+        /// </summary>
+        public byte[] ImageSha1 { get; set; }
+        public byte[] ImageSha256 { get; set; }
+        public PeImageLayout Layout { get; set; }
+
+        /// <summary>
+        /// The file starts with "MZ" but we couldn't parse its headers
+        /// </summary>
+        public bool IsUnparsedImage { get; set; }
+
+        /// <summary>
+        /// Returns the hash catalogs would list this file under, for the given catalog hash algorithm ("SHA256", or null for SHA1).
+        /// That's the image hash for PE files and the flat file hash for anything else.
+        /// Returns null if we couldn't compute it, in which case the caller should ask Windows.
+        /// </summary>
+        /// <param name="hashAlgorithm"></param>
+        /// <returns></returns>
+        public byte[] CatalogHash(string hashAlgorithm)
+        {
+            if (IsUnparsedImage)
+            {
+                return null;
+            }
+
+            bool isSha256 = (hashAlgorithm != null && hashAlgorithm.ToUpperInvariant() == "SHA256");
+            if (Layout != null)
+            {
+                return isSha256 ? ImageSha256 : ImageSha1;
+            }
+            return isSha256 ? Sha256 : Sha1;
+        }
+    }
+
     class Helpers
     {
         /// <summary>
@@ -51,7 +96,24 @@ namespace srsvc
         }
 
         /// <summary>
-        /// Given a file path, compute the file hashes.
+        /// Size of the reads used when hashing files.  Large reads keep the disk streaming and mean we
+        /// call into the hash providers a few hundred times for a big installer instead of tens of thousands.
+        /// </summary>
+        public const int HASH_READ_BUFFER_SIZE = 1024 * 1024;
+
+        /// <summary>
+        /// Opens a file for a single sequential pass.  FileStream's own buffering is disabled (bufferSize 1)
+        /// because our reads are already larger than it would be, and SequentialScan lets the cache manager read ahead.
+        /// </summary>
+        /// <param name="filePath"></param>
+        /// <returns></returns>
+        public static FileStream OpenForSequentialRead(string filePath)
+        {
+            return new FileStream(filePath, FileMode.Open, FileAccess.Read, FileShare.Read, 1, FileOptions.SequentialScan);
+        }
+
+        /// <summary>
+        /// Given a file path, compute the file hashes.  The file is read once and every block is fed to all three digests (see HashPipeline).
         /// </summary>
         /// <param name="filePath"></param>
         /// <param name="md5Hash"></param>
@@ -59,24 +121,12 @@ namespace srsvc
         /// <param name="sha256Hash"></param>
         public static void ComputeHashes(string filePath, out byte[] md5Hash, out byte[] sha1Hash, out byte[] sha256Hash)
         {
-            using (var md5 = MD5Cng.Create())
-            using (var sha1 = SHA1Cng.Create())
-            using (var sha256 = SHA256Cng.Create())
-            using (var input = File.OpenRead(filePath))
+            // The Cng classes call into bcrypt.dll, which uses the CPU's SHA/SSE kernels where they exist
+            using (var md5 = new MD5Cng())
+            using (var sha1 = new SHA1Cng())
+            using (var sha256 = new SHA256Cng())
             {
-                byte[] buffer = new byte[8192];
-                int bytesRead;
-                while ((bytesRead = input.Read(buffer, 0, buffer.Length)) > 0)
-                {
-                    md5.TransformBlock(buffer, 0, bytesRead, buffer, 0);
-                    sha1.TransformBlock(buffer, 0, bytesRead, buffer, 0);
-                    sha256.TransformBlock(buffer, 0, bytesRead, buffer, 0);
-                }
-                // We have to call TransformFinalBlock, but we don't have any
-                // more data - just provide 0 bytes.
-                md5.TransformFinalBlock(buffer, 0, 0);
-                sha1.TransformFinalBlock(buffer, 0, 0);
-                sha256.TransformFinalBlock(buffer, 0, 0);
+                HashPipeline.Compute(filePath, md5, sha1, sha256);
 
                 md5Hash = md5.Hash;
                 sha1Hash = sha1.Hash;
@@ -84,6 +134,62 @@ namespace srsvc
             }
         }
 
+        /// <summary>
+        /// Given a file path, compute the file hashes and, for PE files, the Authenticode image hashes used to look the file
+        /// up in catalogs.  All of them come from a single read of the file.
+        /// </summary>
+        /// <param name="filePath"></param>
+        /// <returns></returns>
+        public static FileHashes ComputeFileHashes(string filePath)
+        {
+            var hashes = new FileHashes();
+
+            using (var input = OpenForSequentialRead(filePath))
+            {
+                hashes.Size = input.Length;
+
+                PeImageLayout layout = null;
+                try
+                {
+                    layout = PeImageLayout.Read(input);
+                }
+                catch (InvalidDataException e)
+                {
+                    // Starts with MZ but we can't make sense of it, so leave the image hash to Windows
+                    Log.Warn("Unable to parse PE headers of {0}: {1}", filePath, e.Message);
+                    hashes.IsUnparsedImage = true;
+                }
+
+                using (var md5 = new MD5Cng())
+                using (var sha1 = new SHA1Cng())
+                using (var sha256 = new SHA256Cng())
+                {
+                    if (layout != null)
+                    {
+                        using (var imageSha1 = new ImageHashAlgorithm(new SHA1Cng(), layout))
+                        using (var imageSha256 = new ImageHashAlgorithm(new SHA256Cng(), layout))
+                        {
+                            HashPipeline.Compute(input, md5, sha1, sha256, imageSha1, imageSha256);
+
+                            hashes.ImageSha1 = imageSha1.Hash;
+                            hashes.ImageSha256 = imageSha256.Hash;
+                            hashes.Layout = layout;
+                        }
+                    }
+                    else
+                    {
+                        HashPipeline.Compute(input, md5, sha1, sha256);
+                    }
+
+                    hashes.Md5 = md5.Hash;
+                    hashes.Sha1 = sha1.Hash;
+                    hashes.Sha256 = sha256.Hash;
+                }
+            }
+
+            return hashes;
+        }
+
         /// <summary>
         /// Given a DateTime, converts it to seconds since the epoch
         /// </summary>
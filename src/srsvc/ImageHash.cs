@@ -0,0 +1,222 @@
+﻿////////////////////////////////////////////////////////////////////////////
+//
+// Summit Route End Point Protection
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+using System;
+using System.Collections.Generic;
+using System.Linq;
+using System.Text;
+using System.IO;
+using System.Security.Cryptography;
+
+namespace srsvc
+{
+    /// <summary>
+    /// The parts of a PE file's headers that the Authenticode image hash skips over.
+    /// Offsets are file offsets.  See "Windows Authenticode Portable Executable Signature Format".
+    /// </summary>
+    public class PeImageLayout
+    {
+        private const ushort IMAGE_DOS_SIGNATURE = 0x5A4D;      // MZ
+        private const uint IMAGE_NT_SIGNATURE = 0x00004550;     // PE\0\0
+        private const ushort IMAGE_NT_OPTIONAL_HDR32_MAGIC = 0x10b;
+        private const ushort IMAGE_NT_OPTIONAL_HDR64_MAGIC = 0x20b;
+        private const int IMAGE_DIRECTORY_ENTRY_SECURITY = 4;
+        private const int IMAGE_FILE_HEADER_SIZE = 20;
+
+        /// <summary>
+        /// Location of OptionalHeader.CheckSum (4 bytes)
+        /// </summary>
+        public long ChecksumOffset { get; private set; }
+
+        /// <summary>
+        /// Location of the certificate table entry in the data directory (8 bytes), or -1 if the image doesn't have one
+        /// </summary>
+        public long CertDirectoryEntryOffset { get; private set; }
+
+        /// <summary>
+        /// Location and size of the certificate table (the WIN_CERTIFICATE structures) itself.  Size is 0 for unsigned files.
+        /// </summary>
+        public long CertTableOffset { get; private set; }
+        public long CertTableSize { get; private set; }
+
+        /// <summary>
+        /// Reads the headers of a PE file.  Returns null if the file doesn't start with "MZ", and throws if it does but the headers are broken.
+        /// The stream position is left at the start of the file.
+        /// </summary>
+        /// <param name="input"></param>
+        /// <returns></returns>
+        public static PeImageLayout Read(Stream input)
+        {
+            var reader = new BinaryReader(input);
+            try
+            {
+                if (input.Length < 0x40 || reader.ReadUInt16() != IMAGE_DOS_SIGNATURE)
+                {
+                    return null;
+                }
+
+                input.Seek(0x3c, SeekOrigin.Begin);
+                uint e_lfanew = reader.ReadUInt32();
+                if (e_lfanew > input.Length - 4 - IMAGE_FILE_HEADER_SIZE - 2)
+                {
+                    throw new InvalidDataException("e_lfanew is past the end of the file");
+                }
+
+                input.Seek(e_lfanew, SeekOrigin.Begin);
+                if (reader.ReadUInt32() != IMAGE_NT_SIGNATURE)
+                {
+                    throw new InvalidDataException("Missing PE signature");
+                }
+
+                long optionalHeader = e_lfanew + 4 + IMAGE_FILE_HEADER_SIZE;
+                input.Seek(optionalHeader, SeekOrigin.Begin);
+                ushort magic = reader.ReadUInt16();
+
+                // The fields before the data directory are 8 bytes bigger in PE32+, as ImageBase and the stack/heap sizes are 64-bit
+                long numberOfRvaAndSizesOffset;
+                if (magic == IMAGE_NT_OPTIONAL_HDR32_MAGIC)
+                {
+                    numberOfRvaAndSizesOffset = optionalHeader + 92;
+                }
+                else if (magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC)
+                {
+                    numberOfRvaAndSizesOffset = optionalHeader + 108;
+                }
+                else
+                {
+                    throw new InvalidDataException(String.Format("Unknown optional header magic {0:x}", magic));
+                }
+
+                var layout = new PeImageLayout();
+                layout.ChecksumOffset = optionalHeader + 64;
+                layout.CertDirectoryEntryOffset = -1;
+
+                input.Seek(numberOfRvaAndSizesOffset, SeekOrigin.Begin);
+                uint numberOfRvaAndSizes = reader.ReadUInt32();
+                if (numberOfRvaAndSizes > IMAGE_DIRECTORY_ENTRY_SECURITY)
+                {
+                    layout.CertDirectoryEntryOffset = numberOfRvaAndSizesOffset + 4 + IMAGE_DIRECTORY_ENTRY_SECURITY * 8;
+                    input.Seek(layout.CertDirectoryEntryOffset, SeekOrigin.Begin);
+
+                    // Unlike the other directories, the certificate table's address is a file offset rather than an RVA
+                    layout.CertTableOffset = reader.ReadUInt32();
+                    layout.CertTableSize = reader.ReadUInt32();
+                    if (layout.CertTableSize != 0 && layout.CertTableOffset + layout.CertTableSize > input.Length)
+                    {
+                        throw new InvalidDataException("Certificate table is past the end of the file");
+                    }
+                }
+
+                return layout;
+            }
+            catch (EndOfStreamException)
+            {
+                throw new InvalidDataException("PE headers are truncated");
+            }
+            finally
+            {
+                input.Seek(0, SeekOrigin.Begin);
+            }
+        }
+
+        /// <summary>
+        /// The ranges of the file that are left out of the image hash, in file order
+        /// </summary>
+        /// <returns></returns>
+        public List<KeyValuePair<long, long>> ExcludedRanges()
+        {
+            var ranges = new List<KeyValuePair<long, long>>();
+            ranges.Add(new KeyValuePair<long, long>(ChecksumOffset, 4));
+            if (CertDirectoryEntryOffset >= 0)
+            {
+                ranges.Add(new KeyValuePair<long, long>(CertDirectoryEntryOffset, 8));
+            }
+            if (CertTableSize != 0)
+            {
+                ranges.Add(new KeyValuePair<long, long>(CertTableOffset, CertTableSize));
+            }
+            return ranges.OrderBy(r => r.Key).ToList();
+        }
+    }
+
+
+    /// <summary>
+    /// Computes the Authenticode image hash of a PE file from a plain front-to-back read of it, so it can be fed from
+    /// the same pass as the flat file digests (see HashPipeline).  This is the hash that catalogs and embedded
+    /// signatures record for the file, and that CryptCATAdminCalcHashFromFileHandle returns.
+    ///
+    /// The format spec hashes the sections in the order of their file offsets and then whatever follows them.
+    /// Linkers lay sections out in that order with nothing between them, so for real files this is the same as
+    /// hashing every byte of the file except the checksum, the certificate table entry and the certificate table.
+    /// </summary>
+    public class ImageHashAlgorithm : HashAlgorithm
+    {
+        private HashAlgorithm inner;
+        private List<KeyValuePair<long, long>> excluded;
+        private long position;
+
+        public ImageHashAlgorithm(HashAlgorithm inner, PeImageLayout layout)
+        {
+            this.inner = inner;
+            this.excluded = layout.ExcludedRanges();
+            this.HashSizeValue = inner.HashSize;
+        }
+
+        public override void Initialize()
+        {
+            inner.Initialize();
+            position = 0;
+        }
+
+        protected override void HashCore(byte[] array, int ibStart, int cbSize)
+        {
+            long start = position;
+            long end = position + cbSize;
+
+            foreach (var range in excluded)
+            {
+                long skipStart = Math.Max(range.Key, start);
+                long skipEnd = Math.Min(range.Key + range.Value, end);
+                if (skipStart >= skipEnd)
+                {
+                    continue;
+                }
+
+                // Hash up to the excluded range, then jump over it
+                if (skipStart > start)
+                {
+                    inner.TransformBlock(array, ibStart + (int)(start - position), (int)(skipStart - start), null, 0);
+                }
+                start = skipEnd;
+            }
+
+            if (end > start)
+            {
+                inner.TransformBlock(array, ibStart + (int)(start - position), (int)(end - start), null, 0);
+            }
+
+            position = end;
+        }
+
+        protected override byte[] HashFinal()
+        {
+            inner.TransformFinalBlock(new byte[0], 0, 0);
+            return inner.Hash;
+        }
+
+        protected override void Dispose(bool disposing)
+        {
+            if (disposing)
+            {
+                inner.Dispose();
+            }
+            base.Dispose(disposing);
+        }
+    }
+}
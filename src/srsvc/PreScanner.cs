@@ -0,0 +1,389 @@
+﻿////////////////////////////////////////////////////////////////////////////
+//
+// Summit Route End Point Protection
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+using System;
+using System.Collections.Generic;
+using System.Collections.Concurrent;
+using System.Linq;
+using System.Text;
+using System.IO;
+using System.Threading;
+using System.Diagnostics;
+using System.Runtime.InteropServices;
+
+namespace srsvc
+{
+    /// <summary>
+    /// Decides on executables before they're run, so their first launch is answered from the cache instead of waiting on
+    /// hashing and verification.
+    ///
+    /// Walks the configured directories in background (low CPU and I/O priority) mode, throttled to a CPU duty cycle and a
+    /// read rate.  The walk is in sorted order and the last finished file is saved to the config, so a restart resumes
+    /// from there.  Once it has finished, later starts don't walk the same directories again.  Executables written while
+    /// we're running are picked up through a FileSystemWatcher and go first.
+    /// </summary>
+    public static class PreScanner
+    {
+        // Give the system time to finish booting before we start reading files
+        private static readonly TimeSpan STARTUP_DELAY = TimeSpan.FromMinutes(2);
+
+        // Fraction of the time we spend working, the rest is spent sleeping
+        private const double CPU_DUTY_CYCLE = 0.25;
+
+        // Limit on how fast we read files
+        private const long MAX_BYTES_PER_SECOND = 4 * 1024 * 1024;
+
+        // Save the cursor after this many files
+        private const int CURSOR_SAVE_INTERVAL = 50;
+
+        // Wait for a new file to stop changing for this long before reading it, as it's probably still being written
+        private static readonly TimeSpan SETTLE_TIME = TimeSpan.FromSeconds(5);
+
+        // Changed files waiting to be analyzed, beyond this we drop them and leave them to be decided on when they run
+        private const int MAX_PENDING_CHANGES = 10000;
+
+        private const string EXECUTABLE_PATTERN = "*.exe";
+
+        private static bool bRunning = false;
+        private static Thread scanThread = null;
+        private static ManualResetEvent stopEvent = new ManualResetEvent(false);
+        private static AutoResetEvent changedEvent = new AutoResetEvent(false);
+
+        private static List<FileSystemWatcher> watchers = new List<FileSystemWatcher>();
+        private static ConcurrentDictionary<string, DateTime> pendingChanges = new ConcurrentDictionary<string, DateTime>(StringComparer.OrdinalIgnoreCase);
+
+        private static long filesScanned = 0;
+        private static long bytesScanned = 0;
+
+        [DllImport("kernel32.dll")]
+        private static extern IntPtr GetCurrentThread();
+
+        [DllImport("kernel32.dll", SetLastError = true)]
+        [return: MarshalAs(UnmanagedType.Bool)]
+        private static extern bool SetThreadPriority(IntPtr hThread, int nPriority);
+
+        // Lowers the thread's CPU, I/O and memory priority (Vista and later)
+        private const int THREAD_MODE_BACKGROUND_BEGIN = 0x00010000;
+        private const int THREAD_MODE_BACKGROUND_END = 0x00020000;
+
+        // Whether this thread is in background mode
+        [ThreadStatic]
+        private static bool inBackgroundMode;
+
+        // Set by EndBackgroundMode, so BeginBackgroundMode only puts back what it took away
+        [ThreadStatic]
+        private static bool resumeBackgroundMode;
+
+        public static void Start()
+        {
+            if (bRunning) return;
+            bRunning = true;
+            stopEvent.Reset();
+
+            scanThread = new Thread(new ThreadStart(ScanLoop));
+            scanThread.Name = "PreScanThread";
+            scanThread.IsBackground = true;
+            scanThread.Priority = ThreadPriority.Lowest;
+            scanThread.Start();
+        }
+
+        public static void Stop()
+        {
+            bRunning = false;
+            stopEvent.Set();
+            foreach (var watcher in watchers)
+            {
+                watcher.EnableRaisingEvents = false;
+            }
+        }
+
+        /// <summary>
+        /// Directories to scan, from the config or else the Program Files directories
+        /// </summary>
+        /// <returns></returns>
+        private static List<string> GetDirectories()
+        {
+            var directories = new List<string>();
+            string configured = (SRSvc.conf != null) ? SRSvc.conf.PreScanDirectories : "";
+            if (!String.IsNullOrEmpty(configured))
+            {
+                directories.AddRange(configured.Split(';').Select(d => d.Trim()).Where(d => d != ""));
+            }
+            else
+            {
+                directories.Add(Environment.GetFolderPath(Environment.SpecialFolder.ProgramFiles));
+                directories.Add(Environment.GetFolderPath(Environment.SpecialFolder.ProgramFilesX86));
+            }
+
+            return directories
+                .Where(d => d != "" && Directory.Exists(d))
+                .Select(d => Path.GetFullPath(d).TrimEnd('\\'))
+                .Distinct(StringComparer.OrdinalIgnoreCase)
+                .OrderBy(d => d + "\\", StringComparer.OrdinalIgnoreCase)
+                .ToList();
+        }
+
+        private static void ScanLoop()
+        {
+            try
+            {
+                if (stopEvent.WaitOne(STARTUP_DELAY)) return;
+
+                if (SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN))
+                {
+                    inBackgroundMode = true;
+                }
+                else
+                {
+                    Log.Warn("Unable to put pre-scan thread in background mode, error {0}", Marshal.GetLastWin32Error());
+                }
+
+                var directories = GetDirectories();
+                WatchDirectories(directories);
+
+                //
+                // Walk the directories, starting after wherever we got to last time.  Once a walk of these directories
+                // has finished, the watchers pick up anything new, so later starts don't walk them again.
+                //
+                string walked = String.Join(";", directories);
+                if (SRSvc.conf.PreScanCompleted.Equals(walked, StringComparison.OrdinalIgnoreCase))
+                {
+                    Log.Info("Pre-scan of {0} directories already complete, watching for new files", directories.Count);
+                }
+                else
+                {
+                    string cursor = SRSvc.conf.PreScanCursor;
+                    Log.Info("Pre-scanning {0} directories{1}", directories.Count, (cursor != "") ? ", resuming after " + cursor : "");
+
+                    int sinceSave = 0;
+                    foreach (var directory in directories)
+                    {
+                        foreach (var filePath in Walk(directory, cursor))
+                        {
+                            if (!bRunning) return;
+
+                            AnalyzeChangedFiles();
+                            Analyze(filePath);
+
+                            if (++sinceSave >= CURSOR_SAVE_INTERVAL)
+                            {
+                                SRSvc.conf.PreScanCursor = filePath;
+                                sinceSave = 0;
+                            }
+                        }
+                    }
+
+                    SRSvc.conf.PreScanCompleted = walked;
+                    SRSvc.conf.PreScanCursor = "";
+                    Log.Info("Pre-scan complete, {0} files ({1} MB)", filesScanned, bytesScanned / (1024 * 1024));
+                }
+
+                //
+                // Now just keep up with new files
+                //
+                var handles = new WaitHandle[] { stopEvent, changedEvent };
+                while (bRunning)
+                {
+                    if (WaitHandle.WaitAny(handles, SETTLE_TIME) == 0) break;
+                    AnalyzeChangedFiles();
+                }
+            }
+            catch (Exception e)
+            {
+                Log.Exception(e, "Exception in pre-scan thread");
+            }
+        }
+
+        /// <summary>
+        /// Yields the executables under a directory in case-insensitive ordinal order of their full paths, skipping
+        /// everything up to and including the cursor.  Directories are ordered as if their names ended in '\', which is
+        /// what makes the order of the walk match the order of the full paths.
+        /// </summary>
+        /// <param name="directory"></param>
+        /// <param name="cursor"></param>
+        /// <returns></returns>
+        private static IEnumerable<string> Walk(string directory, string cursor)
+        {
+            var comparer = StringComparer.OrdinalIgnoreCase;
+            string prefix = directory + "\\";
+
+            // Everything in here sorts before the cursor, so it was done last time
+            if (cursor != "" && comparer.Compare(prefix, cursor) < 0 && !cursor.StartsWith(prefix, StringComparison.OrdinalIgnoreCase))
+            {
+                yield break;
+            }
+
+            var entries = new List<KeyValuePair<string, bool>>();  // Sort key, is directory
+            bool readable = true;
+            try
+            {
+                foreach (var file in Directory.GetFiles(directory, EXECUTABLE_PATTERN))
+                {
+                    entries.Add(new KeyValuePair<string, bool>(file, false));
+                }
+                foreach (var subdirectory in Directory.GetDirectories(directory))
+                {
+                    // Skip junctions, ex. "Application Data" links, so we don't scan things twice or loop
+                    if ((File.GetAttributes(subdirectory) & FileAttributes.ReparsePoint) != 0) continue;
+                    entries.Add(new KeyValuePair<string, bool>(subdirectory + "\\", true));
+                }
+            }
+            catch (Exception e)
+            {
+                if (!(e is UnauthorizedAccessException || e is IOException))
+                {
+                    throw;
+                }
+                readable = false;
+            }
+            if (!readable)
+            {
+                yield break;
+            }
+
+            entries.Sort((a, b) => comparer.Compare(a.Key, b.Key));
+            foreach (var entry in entries)
+            {
+                if (entry.Value)
+                {
+                    foreach (var filePath in Walk(entry.Key.TrimEnd('\\'), cursor))
+                    {
+                        yield return filePath;
+                    }
+                }
+                else if (cursor == "" || comparer.Compare(entry.Key, cursor) > 0)
+                {
+                    yield return entry.Key;
+                }
+            }
+        }
+
+        /// <summary>
+        /// Decides on the file, then sleeps long enough to stay within our CPU and I/O budgets.  Only files that were
+        /// read count towards the I/O budget, not ones that were already known.
+        /// </summary>
+        /// <param name="filePath"></param>
+        private static void Analyze(string filePath)
+        {
+            var stopwatch = Stopwatch.StartNew();
+            long size = 0;
+            try
+            {
+                long length = new FileInfo(filePath).Length;
+                if (Arbiter.PreAnalyze(filePath))
+                {
+                    size = length;
+                }
+            }
+            catch (Exception e)
+            {
+                Log.Debug("Unable to pre-scan {0}: {1}", filePath, e.Message);
+            }
+
+            filesScanned++;
+            bytesScanned += size;
+
+            TimeSpan busy = stopwatch.Elapsed;
+            TimeSpan idle = TimeSpan.FromTicks((long)(busy.Ticks * (1 - CPU_DUTY_CYCLE) / CPU_DUTY_CYCLE));
+            TimeSpan readTime = TimeSpan.FromSeconds((double)size / MAX_BYTES_PER_SECOND) - busy;
+            if (readTime > idle)
+            {
+                idle = readTime;
+            }
+            if (idle > TimeSpan.Zero)
+            {
+                stopEvent.WaitOne(idle);
+            }
+        }
+
+        /// <summary>
+        /// Leaves background mode for a while, if this thread is in it, ex. while holding a lock that launches wait on
+        /// </summary>
+        public static void EndBackgroundMode()
+        {
+            if (inBackgroundMode && SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_END))
+            {
+                inBackgroundMode = false;
+                resumeBackgroundMode = true;
+            }
+        }
+
+        /// <summary>
+        /// Goes back into background mode after EndBackgroundMode
+        /// </summary>
+        public static void BeginBackgroundMode()
+        {
+            if (resumeBackgroundMode && SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN))
+            {
+                inBackgroundMode = true;
+            }
+            resumeBackgroundMode = false;
+        }
+
+        private static void WatchDirectories(List<string> directories)
+        {
+            foreach (var directory in directories)
+            {
+                try
+                {
+                    var watcher = new FileSystemWatcher(directory, EXECUTABLE_PATTERN);
+                    watcher.IncludeSubdirectories = true;
+                    watcher.NotifyFilter = NotifyFilters.FileName | NotifyFilters.LastWrite | NotifyFilters.Size;
+                    watcher.InternalBufferSize = 64 * 1024;
+                    watcher.Created += OnFileChanged;
+                    watcher.Changed += OnFileChanged;
+                    watcher.Renamed += (s, e) => OnFileChanged(s, e);
+                    watcher.EnableRaisingEvents = true;
+                    watchers.Add(watcher);
+                }
+                catch (Exception e)
+                {
+                    Log.Exception(e, "Unable to watch {0} for new executables", directory);
+                }
+            }
+        }
+
+        private static void OnFileChanged(object sender, FileSystemEventArgs e)
+        {
+            if (pendingChanges.Count >= MAX_PENDING_CHANGES && !pendingChanges.ContainsKey(e.FullPath))
+            {
+                return;
+            }
+            pendingChanges[e.FullPath] = DateTime.UtcNow;
+            changedEvent.Set();
+        }
+
+        /// <summary>
+        /// Analyzes the new and changed files that have stopped changing
+        /// </summary>
+        private static void AnalyzeChangedFiles()
+        {
+            DateTime settled = DateTime.UtcNow - SETTLE_TIME;
+            foreach (var change in pendingChanges.Where(c => c.Value < settled).ToList())
+            {
+                if (!bRunning) return;
+
+                DateTime changedAt;
+                if (!pendingChanges.TryRemove(change.Key, out changedAt)) continue;
+                if (changedAt >= settled)
+                {
+                    // Changed again since we looked, so give it more time
+                    pendingChanges.TryAdd(change.Key, changedAt);
+                    continue;
+                }
+
+                if (File.Exists(change.Key))
+                {
+                    Log.Debug("Pre-scanning new file: {0}", change.Key);
+                    Analyze(change.Key);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,238 @@
+﻿////////////////////////////////////////////////////////////////////////////
+//
+// Summit Route End Point Protection
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+using System;
+using System.Collections.Generic;
+using System.Collections.Concurrent;
+using System.Linq;
+using System.Text;
+using System.Threading;
+using System.Diagnostics;
+
+namespace srsvc
+{
+    /// <summary>
+    /// Live tree of the processes on the system, so rules can look at a process's parent and ancestors without querying
+    /// the OS while the driver waits on us.
+    ///
+    /// It's seeded from the processes running when we start, then added to as the driver tells us about new ones.  A
+    /// process's parent is fixed when it's added, so when a pid is reused the new process gets a new node and the
+    /// descendants of the old one still point at the old one.  The driver doesn't tell us about exits, so nodes for
+    /// processes that have gone away are pruned periodically.  Pruned nodes live on as long as a descendant refers to them.
+    /// </summary>
+    public static class ProcessTree
+    {
+        private const int MAX_PROCESSES = 100000;
+        private static readonly TimeSpan PRUNE_INTERVAL = TimeSpan.FromMinutes(5);
+
+        public class Node
+        {
+            public uint Pid { get; private set; }
+            public uint Ppid { get; private set; }
+            public string ImagePath { get; private set; }
+            public DateTime StartTime { get; private set; }
+
+            /// <summary>
+            /// Increases with each process added, so two nodes with the same pid can be told apart
+            /// </summary>
+            public long Generation { get; private set; }
+
+            /// <summary>
+            /// Null if the parent had exited before we knew about it
+            /// </summary>
+            public Node Parent { get; private set; }
+
+            public int Depth { get; private set; }
+
+            // Jumps[k] is the ancestor 2^k levels up, so walking up any number of levels takes log(depth) steps
+            private Node[] jumps;
+
+            internal Node(uint pid, uint ppid, string imagePath, DateTime startTime, long generation, Node parent)
+            {
+                Pid = pid;
+                Ppid = ppid;
+                ImagePath = imagePath;
+                StartTime = startTime;
+                Generation = generation;
+                Parent = parent;
+
+                if (parent == null)
+                {
+                    Depth = 0;
+                    jumps = new Node[0];
+                    return;
+                }
+
+                Depth = parent.Depth + 1;
+                var levels = new List<Node> { parent };
+                while (levels.Count - 1 < levels[levels.Count - 1].jumps.Length)
+                {
+                    levels.Add(levels[levels.Count - 1].jumps[levels.Count - 1]);
+                }
+                jumps = levels.ToArray();
+            }
+
+            /// <summary>
+            /// Returns the ancestor this many levels up, or null if there aren't that many
+            /// </summary>
+            /// <param name="levels"></param>
+            /// <returns></returns>
+            public Node GetAncestor(int levels)
+            {
+                if (levels > Depth) return null;
+
+                Node node = this;
+                for (int k = 0; levels != 0; k++, levels >>= 1)
+                {
+                    if ((levels & 1) != 0)
+                    {
+                        node = node.jumps[k];
+                    }
+                }
+                return node;
+            }
+
+            public override string ToString()
+            {
+                return String.Format("{0} ({1})", ImagePath, Pid);
+            }
+        }
+
+        private static ConcurrentDictionary<uint, Node> processes = new ConcurrentDictionary<uint, Node>();
+        private static long generation = 0;
+
+        private static DateTime lastPruned = DateTime.UtcNow;
+        private static int pruning = 0;
+
+        /// <summary>
+        /// Adds a process that has just been created
+        /// </summary>
+        /// <param name="pid"></param>
+        /// <param name="ppid"></param>
+        /// <param name="imagePath"></param>
+        /// <param name="startTime">UTC</param>
+        /// <returns></returns>
+        public static Node Add(uint pid, uint ppid, string imagePath, DateTime startTime)
+        {
+            // Whatever has this pid now is our parent, unless it started after us, in which case it reused the pid of
+            // a parent that has since exited
+            Node parent;
+            if (!processes.TryGetValue(ppid, out parent) || parent.StartTime > startTime || ppid == pid)
+            {
+                parent = null;
+            }
+
+            var node = new Node(pid, ppid, imagePath, startTime, Interlocked.Increment(ref generation), parent);
+            processes[pid] = node;
+
+            if ((processes.Count > MAX_PROCESSES || DateTime.UtcNow - lastPruned > PRUNE_INTERVAL) && pruning == 0)
+            {
+                // Listing the processes is too slow to do while the driver waits on us
+                ThreadPool.QueueUserWorkItem(state => Prune());
+            }
+            return node;
+        }
+
+        /// <summary>
+        /// Adds the processes that were running when we started
+        /// </summary>
+        /// <param name="running"></param>
+        public static void AddRunning(IEnumerable<SRSvc.PROCESS_INFO> running)
+        {
+            // Parents start before their children, so this order adds them first
+            foreach (var processInfo in running.OrderBy(p => p.StartTime))
+            {
+                Add(processInfo.pid, processInfo.ppid, processInfo.ImageFileName, processInfo.StartTime);
+            }
+            Log.Info("Process tree has {0} processes", processes.Count);
+        }
+
+        /// <summary>
+        /// Returns the node for the process with this pid, or null
+        /// </summary>
+        /// <param name="pid"></param>
+        /// <returns></returns>
+        public static Node Get(uint pid)
+        {
+            Node node;
+            return processes.TryGetValue(pid, out node) ? node : null;
+        }
+
+        /// <summary>
+        /// True if the process is a child, grandchild, etc. of the ancestor
+        /// </summary>
+        /// <param name="process"></param>
+        /// <param name="ancestor"></param>
+        /// <returns></returns>
+        public static bool IsDescendantOf(Node process, Node ancestor)
+        {
+            if (process == null || ancestor == null || process.Depth <= ancestor.Depth)
+            {
+                return false;
+            }
+            return process.GetAncestor(process.Depth - ancestor.Depth) == ancestor;
+        }
+
+        /// <summary>
+        /// Returns the process's parent, grandparent, etc.
+        /// </summary>
+        /// <param name="process"></param>
+        /// <returns></returns>
+        public static IEnumerable<Node> GetAncestry(Node process)
+        {
+            for (Node node = process.Parent; node != null; node = node.Parent)
+            {
+                yield return node;
+            }
+        }
+
+        /// <summary>
+        /// Drops the nodes for processes that are no longer running
+        /// </summary>
+        private static void Prune()
+        {
+            if (Interlocked.Exchange(ref pruning, 1) != 0) return;
+            try
+            {
+                lastPruned = DateTime.UtcNow;
+                DateTime listed = DateTime.UtcNow;
+
+                var running = new HashSet<uint>();
+                foreach (var process in Process.GetProcesses())
+                {
+                    running.Add((uint)process.Id);
+                    process.Dispose();
+                }
+
+                int pruned = 0;
+                foreach (var node in processes.Values)
+                {
+                    // Processes added since we listed them won't be in the list
+                    if (node.StartTime < listed && !running.Contains(node.Pid))
+                    {
+                        // Only remove it if the pid hasn't been reused since we looked
+                        if (((ICollection<KeyValuePair<uint, Node>>)processes).Remove(new KeyValuePair<uint, Node>(node.Pid, node)))
+                        {
+                            pruned++;
+                        }
+                    }
+                }
+                Log.Debug("Pruned {0} exited processes from the process tree, {1} left", pruned, processes.Count);
+            }
+            catch (Exception e)
+            {
+                Log.Exception(e, "Exception pruning the process tree");
+            }
+            finally
+            {
+                pruning = 0;
+            }
+        }
+    }
+}
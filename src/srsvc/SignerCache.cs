@@ -0,0 +1,251 @@
+﻿////////////////////////////////////////////////////////////////////////////
+//
+// Summit Route End Point Protection
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+using System;
+using System.Collections.Generic;
+using System.Collections.Concurrent;
+using System.Linq;
+using System.Text;
+using System.Threading;
+using System.Security.Cryptography;
+using System.Security.Cryptography.X509Certificates;
+
+namespace srsvc
+{
+    /// <summary>
+    /// Remembers the outcome of validating a signer's certificate chain, and the Signer/Certificate fields parsed from it,
+    /// so only the per-file digest has to be checked when the next file from the same publisher shows up.
+    ///
+    /// Embedded signatures are keyed by the signing certificate's thumbprint, and by whether the chain was checked as of
+    /// now or as of a timestamp (see AuthenticodeVerifier).  Catalogs are keyed by the SHA256 of the
+    /// catalog file, since the catalog's signature covers every member hash in it.
+    /// </summary>
+    public static class SignerCache
+    {
+        /// <summary>
+        /// Entries are dropped after this long even if the certificate is still valid, so revocations get noticed
+        /// </summary>
+        private static readonly TimeSpan MAX_ENTRY_AGE = TimeSpan.FromHours(1);
+
+        private const int MAX_ENTRIES = 4096;
+
+        // Log the hit rate every this many lookups
+        private const long STATS_LOG_INTERVAL = 1000;
+
+        public class Entry
+        {
+            /// <summary>
+            /// Result of the chain checks.  Success, or a failure that is about the certificate rather than the file.
+            /// </summary>
+            public WinTrustVerify.WinVerifyTrustResult Result;
+            public DateTime Expires;
+
+            // Parsed signer, null for failures
+            public string Name;
+            public DateTime Timestamp;
+            public Certificate SigningCert;
+
+            /// <summary>
+            /// Returns a new Signer for this entry, as each file's Signer is saved to the DB separately
+            /// </summary>
+            /// <param name="timestamp">Time of signing for this file</param>
+            /// <returns></returns>
+            public Signer CreateSigner(DateTime timestamp)
+            {
+                return new Signer
+                {
+                    Name = Name,
+                    Timestamp = timestamp,
+                    SigningCert = new Certificate
+                    {
+                        Version = SigningCert.Version,
+                        Issuer = SigningCert.Issuer,
+                        SerialNumber = SigningCert.SerialNumber,
+                        DigestAlgorithm = SigningCert.DigestAlgorithm,
+                        DigestEncryptionAlgorithm = SigningCert.DigestEncryptionAlgorithm
+                    }
+                };
+            }
+        }
+
+        private static ConcurrentDictionary<string, Entry> entries = new ConcurrentDictionary<string, Entry>();
+
+        private static long hits = 0;
+        private static long misses = 0;
+
+        public static long Hits
+        {
+            get { return Interlocked.Read(ref hits); }
+        }
+
+        public static long Misses
+        {
+            get { return Interlocked.Read(ref misses); }
+        }
+
+        /// <summary>
+        /// Returns the cached entry for this key, unless it has expired
+        /// </summary>
+        /// <param name="key"></param>
+        /// <param name="entry"></param>
+        /// <returns></returns>
+        public static bool TryGet(string key, out Entry entry)
+        {
+            entry = null;
+            if (key != null && entries.TryGetValue(key, out entry))
+            {
+                if (entry.Expires > DateTime.UtcNow)
+                {
+                    CountLookup(ref hits);
+                    return true;
+                }
+
+                entries.TryRemove(key, out entry);
+                entry = null;
+            }
+
+            CountLookup(ref misses);
+            return false;
+        }
+
+        /// <summary>
+        /// Same as TryGet, but only returns entries for chains that validated
+        /// </summary>
+        /// <param name="key"></param>
+        /// <param name="entry"></param>
+        /// <returns></returns>
+        public static bool TryGetTrusted(string key, out Entry entry)
+        {
+            if (TryGet(key, out entry) && entry.Result == WinTrustVerify.WinVerifyTrustResult.Success)
+            {
+                return true;
+            }
+            entry = null;
+            return false;
+        }
+
+        private static void CountLookup(ref long counter)
+        {
+            Interlocked.Increment(ref counter);
+            if ((Hits + Misses) % STATS_LOG_INTERVAL == 0)
+            {
+                Log.Info("Signer cache: {0} hits, {1} misses, {2} entries", Hits, Misses, entries.Count);
+            }
+        }
+
+        /// <summary>
+        /// Records a validated signer
+        /// </summary>
+        /// <param name="key"></param>
+        /// <param name="signer"></param>
+        /// <param name="notAfter">When the signing certificate expires</param>
+        public static void AddTrusted(string key, Signer signer, DateTime notAfter)
+        {
+            // The same few names and issuers show up under many keys (ex. one publisher's yearly certificates)
+            signer.SigningCert.Issuer = StringTable.Intern(signer.SigningCert.Issuer);
+
+            Add(key, new Entry
+            {
+                Result = WinTrustVerify.WinVerifyTrustResult.Success,
+                Expires = notAfter,
+                Name = StringTable.Intern(signer.Name),
+                Timestamp = signer.Timestamp,
+                SigningCert = signer.SigningCert
+            });
+        }
+
+        /// <summary>
+        /// Records a chain that failed validation, so we don't keep building it for every file signed with it.
+        /// Failures that are about the file itself, such as a bad digest, are not cached.
+        /// </summary>
+        /// <param name="key"></param>
+        /// <param name="result"></param>
+        /// <param name="notAfter"></param>
+        public static void AddUntrusted(string key, WinTrustVerify.WinVerifyTrustResult result, DateTime notAfter)
+        {
+            if (!IsChainResult(result))
+            {
+                return;
+            }
+            Add(key, new Entry { Result = result, Expires = notAfter });
+        }
+
+        private static void Add(string key, Entry entry)
+        {
+            if (key == null)
+            {
+                return;
+            }
+
+            DateTime maxExpiry = DateTime.UtcNow + MAX_ENTRY_AGE;
+            if (entry.Expires != DateTime.MaxValue)
+            {
+                // Certificate times are local
+                entry.Expires = entry.Expires.ToUniversalTime();
+            }
+            if (entry.Expires > maxExpiry)
+            {
+                entry.Expires = maxExpiry;
+            }
+            if (entry.Expires <= DateTime.UtcNow)
+            {
+                // Certificate has already expired, so there's nothing to remember
+                return;
+            }
+
+            if (entries.Count >= MAX_ENTRIES)
+            {
+                // A handful of publishers sign almost everything, so just start over rather than tracking usage
+                Log.Info("Signer cache is full, clearing it");
+                entries.Clear();
+            }
+            entries[key] = entry;
+        }
+
+        /// <summary>
+        /// True for WinVerifyTrust results that depend only on the signer's certificate chain
+        /// </summary>
+        /// <param name="result"></param>
+        /// <returns></returns>
+        public static bool IsChainResult(WinTrustVerify.WinVerifyTrustResult result)
+        {
+            switch (result)
+            {
+                case WinTrustVerify.WinVerifyTrustResult.Success:
+                case WinTrustVerify.WinVerifyTrustResult.SubjectNotTrusted:
+                case WinTrustVerify.WinVerifyTrustResult.SubjectExplicitlyDistrusted:
+                case WinTrustVerify.WinVerifyTrustResult.SubjectCertExpired:
+                case WinTrustVerify.WinVerifyTrustResult.SubjectCertificateRevoked:
+                    return true;
+                default:
+                    return false;
+            }
+        }
+
+        /// <summary>
+        /// Key for a certificate
+        /// </summary>
+        /// <param name="cert"></param>
+        /// <returns></returns>
+        public static string CertificateKey(X509Certificate cert)
+        {
+            return "cert:" + cert.GetCertHashString();
+        }
+
+        /// <summary>
+        /// Key for a catalog file
+        /// </summary>
+        /// <param name="catalog"></param>
+        /// <returns></returns>
+        public static string CatalogKey(CatalogIndex.CatalogEntry catalog)
+        {
+            return "cat:" + Helpers.ByteArrayToHexString(catalog.Sha256);
+        }
+    }
+}
@@ -0,0 +1,153 @@
+﻿////////////////////////////////////////////////////////////////////////////
+//
+// Summit Route End Point Protection
+//
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree.
+//
+/////////////////////////////////////////////////////////////////////////////
+
+using System;
+using System.Collections.Generic;
+using System.Collections.Concurrent;
+using System.Linq;
+using System.Text;
+using System.IO;
+
+namespace srsvc
+{
+    /// <summary>
+    /// Assigns IDs to strings in the order they're added, so records can refer to a repeated string (ex. a command line
+    /// like "svchost.exe -k netsvcs") by ID instead of carrying a copy of it.  IDs are only meaningful within the table
+    /// that assigned them.
+    ///
+    /// Also has a shared pool for deduplicating long lived strings in memory, and helpers for writing sorted paths with
+    /// the prefix they share with the previous path left out.
+    /// </summary>
+    public class StringTable
+    {
+        private Dictionary<string, int> ids = new Dictionary<string, int>(StringComparer.Ordinal);
+        private List<string> strings = new List<string>();
+
+        public int Count
+        {
+            get { return strings.Count; }
+        }
+
+        /// <summary>
+        /// Returns the string's ID, adding it if it's new
+        /// </summary>
+        /// <param name="value"></param>
+        /// <param name="added">True if the string was not already in the table</param>
+        /// <returns></returns>
+        public int GetOrAdd(string value, out bool added)
+        {
+            int id;
+            if (ids.TryGetValue(value, out id))
+            {
+                added = false;
+                return id;
+            }
+
+            id = strings.Count;
+            strings.Add(value);
+            ids[value] = id;
+            added = true;
+            return id;
+        }
+
+        public bool TryGetString(int id, out string value)
+        {
+            if (id < 0 || id >= strings.Count)
+            {
+                value = null;
+                return false;
+            }
+            value = strings[id];
+            return true;
+        }
+
+        public void Clear()
+        {
+            ids.Clear();
+            strings.Clear();
+        }
+
+        /*---------------------------------------------------------------------- */
+        // Shared pool
+
+        // Beyond this the pool is cleared, as it's only an optimization
+        private const int MAX_POOLED_STRINGS = 10000;
+
+        private static ConcurrentDictionary<string, string> pool = new ConcurrentDictionary<string, string>(StringComparer.Ordinal);
+
+        /// <summary>
+        /// Returns the pooled copy of the string, so strings repeated across many objects, such as signer names and
+        /// certificate issuers, are only held in memory once.  Unlike String.Intern, the pool can be cleared.
+        /// </summary>
+        /// <param name="value"></param>
+        /// <returns></returns>
+        public static string Intern(string value)
+        {
+            if (value == null)
+            {
+                return null;
+            }
+
+            string pooled;
+            if (pool.TryGetValue(value, out pooled))
+            {
+                return pooled;
+            }
+            if (pool.Count >= MAX_POOLED_STRINGS)
+            {
+                pool.Clear();
+            }
+            return pool.GetOrAdd(value, value);
+        }
+
+        /*---------------------------------------------------------------------- */
+        // Prefix compression
+
+        /// <summary>
+        /// Writes the string as the length of the prefix it shares with the previous string, followed by the rest of it.
+        /// Paths written in sorted order mostly share their directories with the path before them.
+        /// </summary>
+        /// <param name="writer"></param>
+        /// <param name="previous"></param>
+        /// <param name="value"></param>
+        public static void WritePrefixCompressed(BinaryWriter writer, string previous, string value)
+        {
+            int prefixLength = 0;
+            int maxLength = Math.Min(previous.Length, value.Length);
+            while (prefixLength < maxLength && previous[prefixLength] == value[prefixLength])
+            {
+                prefixLength++;
+            }
+            if (prefixLength > 0 && Char.IsHighSurrogate(value[prefixLength - 1]))
+            {
+                // Don't split a surrogate pair, as half of one can't be encoded
+                prefixLength--;
+            }
+
+            writer.Write(prefixLength);
+            writer.Write(value.Substring(prefixLength));
+        }
+
+        /// <summary>
+        /// Reads a string written by WritePrefixCompressed
+        /// </summary>
+        /// <param name="reader"></param>
+        /// <param name="previous"></param>
+        /// <returns></returns>
+        public static string ReadPrefixCompressed(BinaryReader reader, string previous)
+        {
+            int prefixLength = reader.ReadInt32();
+            if (prefixLength < 0 || prefixLength > previous.Length)
+            {
+                throw new InvalidDataException("Bad prefix length");
+            }
+            return previous.Substring(0, prefixLength) + reader.ReadString();
+        }
+    }
+}
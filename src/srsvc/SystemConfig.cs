@@ -80,6 +80,92 @@ namespace srsvc
         }
 
 
+        /// <summary>
+        /// Seconds allowed to connect to the server and get its response to a post
+        /// </summary>
+        private int _beaconRequestTimeout = 30;
+        public int BeaconRequestTimeout
+        {
+            get { return _beaconRequestTimeout; }
+            set
+            {
+                setConfigValue("beaconRequestTimeout", value.ToString());
+                this._beaconRequestTimeout = value;
+            }
+        }
+
+        /// <summary>
+        /// Seconds allowed for each read or write of a post's data, once connected
+        /// </summary>
+        private int _beaconReadTimeout = 60;
+        public int BeaconReadTimeout
+        {
+            get { return _beaconReadTimeout; }
+            set
+            {
+                setConfigValue("beaconReadTimeout", value.ToString());
+                this._beaconReadTimeout = value;
+            }
+        }
+
+        /// <summary>
+        /// Seconds the server may hold a request for commands open before replying that there are none.  0 turns off
+        /// polling for commands, so they only arrive with heartbeats.
+        /// </summary>
+        private int _commandWaitTime = 60;
+        public int CommandWaitTime
+        {
+            get { return _commandWaitTime; }
+            set
+            {
+                setConfigValue("commandWaitTime", value.ToString());
+                this._commandWaitTime = value;
+            }
+        }
+
+        /// <summary>
+        /// Megabytes of disk the process events waiting to be sent may take, before the oldest are dropped
+        /// </summary>
+        private int _spoolMaxSize = 256;
+        public int SpoolMaxSize
+        {
+            get { return _spoolMaxSize; }
+            set
+            {
+                setConfigValue("spoolMaxSize", value.ToString());
+                this._spoolMaxSize = value;
+            }
+        }
+
+        /// <summary>
+        /// Days process events wait to be sent before they're dropped
+        /// </summary>
+        private int _spoolMaxAge = 30;
+        public int SpoolMaxAge
+        {
+            get { return _spoolMaxAge; }
+            set
+            {
+                setConfigValue("spoolMaxAge", value.ToString());
+                this._spoolMaxAge = value;
+            }
+        }
+
+        /// <summary>
+        /// Most process events per second to send when catching up after the server was unreachable.  0 for no limit.
+        /// </summary>
+        private int _spoolDrainRate = 1000;
+        public int SpoolDrainRate
+        {
+            get { return _spoolDrainRate; }
+            set
+            {
+                setConfigValue("spoolDrainRate", value.ToString());
+                this._spoolDrainRate = value;
+            }
+        }
+
+
         /// <summary>
         /// 
         /// </summary>
@@ -94,6 +180,91 @@ namespace srsvc
             }
         }
 
+        /// <summary>
+        /// Thumbprints of extra root certificates to trust for code signing, separated by ';'.
+        /// Used by AuthenticodeVerifier in addition to the machine's trusted roots.
+        /// </summary>
+        private string _trustedRoots = "";
+        public string TrustedRoots
+        {
+            get { return _trustedRoots; }
+            set
+            {
+                setConfigValue("trustedRoots", value);
+                this._trustedRoots = value;
+            }
+        }
+
+        /// <summary>
+        /// Directories the PreScanner looks for executables in, separated by ';'.  Empty means the Program Files directories.
+        /// </summary>
+        private string _preScanDirectories = "";
+        public string PreScanDirectories
+        {
+            get { return _preScanDirectories; }
+            set
+            {
+                setConfigValue("preScanDirectories", value);
+                this._preScanDirectories = value;
+            }
+        }
+
+        /// <summary>
+        /// Last file the PreScanner finished with, so a restart picks up where it left off.  Empty when there's no scan in progress.
+        /// </summary>
+        private string _preScanCursor = "";
+        public string PreScanCursor
+        {
+            get { return _preScanCursor; }
+            set
+            {
+                setConfigValue("preScanCursor", value);
+                this._preScanCursor = value;
+            }
+        }
+
+        /// <summary>
+        /// Directories the PreScanner last finished walking, so a restart only watches for new files.  Empty until a walk finishes.
+        /// </summary>
+        private string _preScanCompleted = "";
+        public string PreScanCompleted
+        {
+            get { return _preScanCompleted; }
+            set
+            {
+                setConfigValue("preScanCompleted", value);
+                this._preScanCompleted = value;
+            }
+        }
+
+        /// <summary>
+        /// ID of the last process event in the DB that was sent to the server, or -1 if not yet known
+        /// </summary>
+        private long _processEventCursor = -1;
+        public long ProcessEventCursor
+        {
+            get { return _processEventCursor; }
+            set
+            {
+                setConfigValue("processEventCursor", value.ToString());
+                this._processEventCursor = value;
+            }
+        }
+
+        /// <summary>
+        /// ID of the last catalog file in the DB that was sent to the server, or -1 if not yet known
+        /// </summary>
+        private long _catalogFileCursor = -1;
+        public long CatalogFileCursor
+        {
+            get { return _catalogFileCursor; }
+            set
+            {
+                setConfigValue("catalogFileCursor", value.ToString());
+                this._catalogFileCursor = value;
+            }
+        }
+
         /// <summary>
         /// Initializer
         /// </summary>
@@ -116,6 +287,10 @@ namespace srsvc
             Log.Info("  System Guid: {0}", this.SystemUUID);
             Log.Info("  Beacon interval: {0} seconds", this.BeaconInterval);
             Log.Info("  Beacon server: {0}", this.BeaconServer);
+            Log.Info("  Beacon timeouts: {0}s request, {1}s read", this.BeaconRequestTimeout, this.BeaconReadTimeout);
+            Log.Info("  Command wait time: {0} seconds", this.CommandWaitTime);
+            Log.Info("  Spool: {0}MB, {1} days, {2} events/s", this.SpoolMaxSize, this.SpoolMaxAge, this.SpoolDrainRate);
+            Log.Info("  Trusted roots: {0}", this.TrustedRoots);
         }
 
         private string getConfigValue(string name, string defaultValue)
@@ -146,8 +321,20 @@ namespace srsvc
             
             string beaconIntervalStr = getConfigValue("beaconInterval", "60");
             this._beaconInterval = Convert.ToInt32(beaconIntervalStr);
+            this._beaconRequestTimeout = Convert.ToInt32(getConfigValue("beaconRequestTimeout", this._beaconRequestTimeout.ToString()));
+            this._beaconReadTimeout = Convert.ToInt32(getConfigValue("beaconReadTimeout", this._beaconReadTimeout.ToString()));
+            this._commandWaitTime = Convert.ToInt32(getConfigValue("commandWaitTime", this._commandWaitTime.ToString()));
+            this._spoolMaxSize = Convert.ToInt32(getConfigValue("spoolMaxSize", this._spoolMaxSize.ToString()));
+            this._spoolMaxAge = Convert.ToInt32(getConfigValue("spoolMaxAge", this._spoolMaxAge.ToString()));
+            this._spoolDrainRate = Convert.ToInt32(getConfigValue("spoolDrainRate", this._spoolDrainRate.ToString()));
 
             this._beaconServer = getConfigValue("beaconServer", "");
+            this._trustedRoots = getConfigValue("trustedRoots", "");
+            this._preScanDirectories = getConfigValue("preScanDirectories", "");
+            this._preScanCursor = getConfigValue("preScanCursor", "");
+            this._preScanCompleted = getConfigValue("preScanCompleted", "");
+            this._processEventCursor = Convert.ToInt64(getConfigValue("processEventCursor", this._processEventCursor.ToString()));
+            this._catalogFileCursor = Convert.ToInt64(getConfigValue("catalogFileCursor", this._catalogFileCursor.ToString()));
 
             return true;
         }
@@ -269,18 +269,27 @@ namespace srsvc
             IntPtr pcCatalogContext = IntPtr.Zero;
             IntPtr hCatAdmin;
 
-            public WinTrustCatalogInfo(String _catalogFilePath, String _memberTag, String _memberFilePath, IntPtr _hCatAdmin)
+            public WinTrustCatalogInfo(String _catalogFilePath, String _memberTag, String _memberFilePath, byte[] _calculatedFileHash, IntPtr _hCatAdmin)
             {
                 pcwszCatalogFilePath = Marshal.StringToCoTaskMemAuto(_catalogFilePath);
                 pcwszMemberTag = Marshal.StringToCoTaskMemAuto(_memberTag);
                 pcwszMemberFilePath = Marshal.StringToCoTaskMemAuto(_memberFilePath);
                 hCatAdmin = _hCatAdmin;
+
+                // With the hash given, WinVerifyTrust doesn't read the file to compute it again
+                if (_calculatedFileHash != null)
+                {
+                    cbCalculatedFileHash = (UInt32)_calculatedFileHash.Length;
+                    pbCalculatedFileHash = Marshal.AllocCoTaskMem(_calculatedFileHash.Length);
+                    Marshal.Copy(_calculatedFileHash, 0, pbCalculatedFileHash, _calculatedFileHash.Length);
+                }
             }
             ~WinTrustCatalogInfo()
             {
                 Marshal.FreeCoTaskMem(pcwszCatalogFilePath);
                 Marshal.FreeCoTaskMem(pcwszMemberTag);
                 Marshal.FreeCoTaskMem(pcwszMemberFilePath);
+                Marshal.FreeCoTaskMem(pbCalculatedFileHash);
             }
         }
 
@@ -306,7 +315,7 @@ namespace srsvc
             WinTrustDataUIContext UIContext = WinTrustDataUIContext.Execute;
 
             // constructor for silent WinTrustDataChoice.File check
-            public WinTrustData(String _fileName, bool isCatalog, String _hash, String _catalogPath, IntPtr hCatAdmin)
+            public WinTrustData(String _fileName, bool isCatalog, String _hash, String _catalogPath, IntPtr hCatAdmin, byte[] _calculatedHash = null)
             {
                 // On Win7SP1+, don't allow MD2 or MD4 signatures
                 if ((Environment.OSVersion.Version.Major > 6) ||
@@ -319,7 +328,7 @@ namespace srsvc
                 if (isCatalog)
                 {
                     dwUnionChoice = WinTrustDataChoice.Catalog;
-                    WinTrustCatalogInfo wtfiData = new WinTrustCatalogInfo(_catalogPath, _hash, _fileName, hCatAdmin);
+                    WinTrustCatalogInfo wtfiData = new WinTrustCatalogInfo(_catalogPath, _hash, _fileName, _calculatedHash, hCatAdmin);
 
                     FileInfoPtr = Marshal.AllocCoTaskMem(Marshal.SizeOf(typeof(WinTrustCatalogInfo)));
                     Marshal.StructureToPtr(wtfiData, FileInfoPtr, false);
@@ -502,6 +511,11 @@ namespace srsvc
             // GUID of the action to perform
             private const string WINTRUST_ACTION_GENERIC_VERIFY_V2 = "{00AAC56B-CD44-11d0-8CC2-00C04FC295EE}";
 
+            /// <summary>
+            /// Gets the signer from a successful WinVerifyTrust.  The parsed fields are cached by certificate, see SignerCache.
+            /// </summary>
+            /// <param name="StateData"></param>
+            /// <returns></returns>
             public static Signer GetSignerFromStateData(IntPtr StateData)
             {
                 // Sanity check
@@ -557,6 +571,15 @@ namespace srsvc
                 // This is actually a list, but I only care about the first element
                 CryptProviderCert cert = providerCerts[0];
 
+                // Many files share a signer, so skip parsing the cert if we've already seen it
+                var x509 = new X509Certificate2(cert.pCert);
+                string cacheKey = SignerCache.CertificateKey(x509);
+                SignerCache.Entry cached;
+                if (SignerCache.TryGetTrusted(cacheKey, out cached))
+                {
+                    return cached.CreateSigner(DateTime.FromFileTime((long)sgnr.sftVerifyAsOf));
+                }
+
                 // 4. Get cert context
                 CertContext certContext = (CertContext)Marshal.PtrToStructure(cert.pCert, typeof(CertContext));
 
@@ -602,6 +625,8 @@ namespace srsvc
                     SigningCert = certEntity
                 };
 
+                SignerCache.AddTrusted(cacheKey, signer, x509.NotAfter);
+
                 return signer;
             }
 
@@ -755,14 +780,17 @@ namespace srsvc
             /// Given a catalog file, extracts the signer name
             /// </summary>
             /// <param name="FileName"></param>
-            /// <param name="SignerName"></param>
+            /// <param name="CatalogName"></param>
+            /// <param name="FileHash">The file's catalog hash, which WinVerifyTrust uses instead of hashing the file</param>
+            /// <param name="Signers"></param>
+            /// <param name="hCatAdmin"></param>
             /// <returns></returns>
-            public static WinVerifyTrustResult VerifyCatalogFile(string FileName, string CatalogName, string Hash, out List<Signer> Signers, IntPtr hCatAdmin)
+            public static WinVerifyTrustResult VerifyCatalogFile(string FileName, string CatalogName, byte[] FileHash, out List<Signer> Signers, IntPtr hCatAdmin)
             {
                 // Much of this comes from: http://forum.sysinternals.com/howto-verify-the-digital-signature-of-a-file_topic19247.html
 
                 WinVerifyTrustResult result = WinVerifyTrustResult.FileNotSigned;
-                WinTrustData wtd = new WinTrustData(FileName, true, Hash, CatalogName, hCatAdmin);
+                WinTrustData wtd = new WinTrustData(FileName, true, ByteArrayToString(FileHash), CatalogName, hCatAdmin, FileHash);
                 wtd.dwStateAction = WinTrustDataStateAction.Verify;
                 Guid guidAction = new Guid(WINTRUST_ACTION_GENERIC_VERIFY_V2);
                 Signers = null;
@@ -798,21 +826,48 @@ namespace srsvc
             /// </summary>
             /// <param name="FileName"></param>
             /// <param name="HashAlgorithm"></param>
+            /// <param name="Hashes">Hashes already computed for this file, or null to have Windows hash the file</param>
             /// <param name="SignerName"></param>
             /// <returns></returns>
-            public static WinVerifyTrustResult VerifyFileFromCatalog(string FileName, string HashAlgorithm, out List<Signer> Signers)
+            public static WinVerifyTrustResult VerifyFileFromCatalog(string FileName, string HashAlgorithm, FileHashes Hashes, out List<Signer> Signers)
             {
                 WinVerifyTrustResult result = WinVerifyTrustResult.FileNotSigned;
                 Signers = null; // TODO MUST set this
 
+                // If we've already hashed the file we don't need Windows to read it all again
+                byte[] precomputedHash = null;
+                if (Hashes != null)
+                {
+                    // Before Windows 8 there's only the SHA1 catalog context, whatever algorithm was asked for
+                    bool hasContext2 = FunctionExists("wintrust.dll", "CryptCATAdminAcquireContext2");
+                    precomputedHash = Hashes.CatalogHash(hasContext2 ? HashAlgorithm : null);
+                }
+
+                //
+                // Look the hash up in our own index of the catalogs, instead of having Windows search them all
+                //
+                CatalogIndex.CatalogEntry indexedCatalog = null;
+                if (precomputedHash != null)
+                {
+                    indexedCatalog = CatalogIndex.Lookup(precomputedHash);
+                    if (indexedCatalog == null && CatalogIndex.IsCurrent)
+                    {
+                        // The index covers every catalog on the system, so this file isn't in any of them
+                        return WinVerifyTrustResult.FileNotSigned;
+                    }
+                }
+
                 //
                 // Check file is not too large
                 //
-                long length = new System.IO.FileInfo(FileName).Length;
-                if (length > 32 * 1024 * 1024)
+                if (precomputedHash == null)
                 {
-                    // TODO IMPORTANT Do something better for large files
-                    return WinVerifyTrustResult.FileNotSigned;
+                    long length = new System.IO.FileInfo(FileName).Length;
+                    if (length > 32 * 1024 * 1024)
+                    {
+                        // TODO IMPORTANT Do something better for large files
+                        return WinVerifyTrustResult.FileNotSigned;
+                    }
                 }
 
                 IntPtr phCatAdmin = IntPtr.Zero;
@@ -841,64 +896,103 @@ namespace srsvc
                     }
                 }
 
-                //
-                // Get handle to file
-                //
-                SafeFileHandle hFile = CreateFile(FileName, GENERIC_READ, FILE_SHARE_READ, IntPtr.Zero, OPEN_EXISTING, 0, IntPtr.Zero);
-                if (hFile.IsInvalid)
+                UInt32 fileHashLength;
+                IntPtr fileHash;
+                if (precomputedHash != null)
                 {
-                    Log.Error("Call to CreateFile failed with error {0}", Marshal.GetLastWin32Error());
-                    return WinVerifyTrustResult.FileNotSigned;
-                }
+                    fileHashLength = (UInt32)precomputedHash.Length;
+                    fileHash = Marshal.AllocHGlobal(precomputedHash.Length);
+                    Marshal.Copy(precomputedHash, 0, fileHash, precomputedHash.Length);
 
-                //
-                // Calc hash
-                //
-                UInt32 fileHashLength = 16;
-                IntPtr fileHash = Marshal.AllocHGlobal((int)fileHashLength);
-                if (FunctionExists("wintrust.dll", "CryptCATAdminCalcHashFromFileHandle2"))
-                {
-                    // Get size of the file hash to be used
-                    if (!CryptCATAdminCalcHashFromFileHandle2(phCatAdmin, hFile, ref fileHashLength, fileHash, 0))
+                    if (indexedCatalog != null)
                     {
-                        // Alloc the correct amount and try again
-                        Marshal.FreeHGlobal(fileHash);
-                        fileHash = Marshal.AllocHGlobal((int)fileHashLength);
+                        Database.LogCatalogFile(indexedCatalog);
 
-                        if (!CryptCATAdminCalcHashFromFileHandle2(phCatAdmin, hFile, ref fileHashLength, fileHash, 0))
+                        // Our hash matched a member of this exact catalog, so if its signature has been checked already we're done
+                        string catalogKey = SignerCache.CatalogKey(indexedCatalog);
+                        SignerCache.Entry cached;
+                        if (SignerCache.TryGetTrusted(catalogKey, out cached))
                         {
-                            // Something went wrong
-                            Log.Error("Call to CryptCATAdminCalcHashFromFileHandle2 failed with error {0}", Marshal.GetLastWin32Error());
-                            // Clean up
-                            CryptCATAdminReleaseContext(phCatAdmin, 0);
-                            Marshal.FreeHGlobal(fileHash);
-                            return WinVerifyTrustResult.FileNotSigned;
+                            Signers = new List<Signer>();
+                            Signers.Add(cached.CreateSigner(cached.Timestamp));
+                            result = WinVerifyTrustResult.Success;
+                        }
+                        else
+                        {
+                            result = VerifyCatalogFile(FileName, indexedCatalog.Path, precomputedHash, out Signers, phCatAdmin);
+                            if (result == WinVerifyTrustResult.Success && Signers != null && Signers[0] != null)
+                            {
+                                // Catalogs are timestamped, so the entry is only limited by the cache's maximum age
+                                SignerCache.AddTrusted(catalogKey, Signers[0], DateTime.MaxValue);
+                            }
                         }
+
+                        CryptCATAdminReleaseContext(phCatAdmin, 0);
+                        Marshal.FreeHGlobal(fileHash);
+                        return result;
                     }
                 }
                 else
                 {
-                    // Get size of the file hash to be used
-                    if (!CryptCATAdminCalcHashFromFileHandle(hFile, ref fileHashLength, fileHash, 0))
+                    //
+                    // Get handle to file
+                    //
+                    SafeFileHandle hFile = CreateFile(FileName, GENERIC_READ, FILE_SHARE_READ, IntPtr.Zero, OPEN_EXISTING, 0, IntPtr.Zero);
+                    if (hFile.IsInvalid)
                     {
-                        // Alloc the correct amount and try again
-                        Marshal.FreeHGlobal(fileHash);
-                        fileHash = Marshal.AllocHGlobal((int)fileHashLength);
+                        Log.Error("Call to CreateFile failed with error {0}", Marshal.GetLastWin32Error());
+                        return WinVerifyTrustResult.FileNotSigned;
+                    }
+
+                    //
+                    // Calc hash
+                    //
+                    fileHashLength = 16;
+                    fileHash = Marshal.AllocHGlobal((int)fileHashLength);
+                    if (FunctionExists("wintrust.dll", "CryptCATAdminCalcHashFromFileHandle2"))
+                    {
+                        // Get size of the file hash to be used
+                        if (!CryptCATAdminCalcHashFromFileHandle2(phCatAdmin, hFile, ref fileHashLength, fileHash, 0))
+                        {
+                            // Alloc the correct amount and try again
+                            Marshal.FreeHGlobal(fileHash);
+                            fileHash = Marshal.AllocHGlobal((int)fileHashLength);
 
+                            if (!CryptCATAdminCalcHashFromFileHandle2(phCatAdmin, hFile, ref fileHashLength, fileHash, 0))
+                            {
+                                // Something went wrong
+                                Log.Error("Call to CryptCATAdminCalcHashFromFileHandle2 failed with error {0}", Marshal.GetLastWin32Error());
+                                // Clean up
+                                CryptCATAdminReleaseContext(phCatAdmin, 0);
+                                Marshal.FreeHGlobal(fileHash);
+                                return WinVerifyTrustResult.FileNotSigned;
+                            }
+                        }
+                    }
+                    else
+                    {
+                        // Get size of the file hash to be used
                         if (!CryptCATAdminCalcHashFromFileHandle(hFile, ref fileHashLength, fileHash, 0))
                         {
-                            // Something went wrong
-                            Log.Error("Call to CryptCATAdminCalcHashFromFileHandle2 failed with error {0}", Marshal.GetLastWin32Error());
-                            // Clean up
-                            CryptCATAdminReleaseContext(phCatAdmin, 0);
+                            // Alloc the correct amount and try again
                             Marshal.FreeHGlobal(fileHash);
-                            return WinVerifyTrustResult.FileNotSigned;
+                            fileHash = Marshal.AllocHGlobal((int)fileHashLength);
+
+                            if (!CryptCATAdminCalcHashFromFileHandle(hFile, ref fileHashLength, fileHash, 0))
+                            {
+                                // Something went wrong
+                                Log.Error("Call to CryptCATAdminCalcHashFromFileHandle2 failed with error {0}", Marshal.GetLastWin32Error());
+                                // Clean up
+                                CryptCATAdminReleaseContext(phCatAdmin, 0);
+                                Marshal.FreeHGlobal(fileHash);
+                                return WinVerifyTrustResult.FileNotSigned;
+                            }
                         }
                     }
-                }
 
-                // Close the file so we don't get a sharing violation later
-                hFile.Close();
+                    // Close the file so we don't get a sharing violation later
+                    hFile.Close();
+                }
 
                 IntPtr hCatInfo = IntPtr.Zero;
                 hCatInfo = CryptCATAdminEnumCatalogFromHash(phCatAdmin, fileHash, fileHashLength, 0, ref hCatInfo);
@@ -914,15 +1008,13 @@ namespace srsvc
 
                         Database.LogCatalogFile(catalogFileName);
 
-                        // Get the hash as a string
                         var fileHashByteArray = new byte[fileHashLength];
                         System.Runtime.InteropServices.Marshal.Copy(fileHash, fileHashByteArray, 0, (int)fileHashLength);
-                        string fileHashTag = ByteArrayToString(fileHashByteArray);
 
                         //
                         // Use WinVerifyTrust to get the rest of the info
                         //
-                        result = VerifyCatalogFile(FileName, catalogFileName, fileHashTag, out Signers, phCatAdmin);
+                        result = VerifyCatalogFile(FileName, catalogFileName, fileHashByteArray, out Signers, phCatAdmin);
 
                         found = true;
                         break;
@@ -974,16 +1066,38 @@ namespace srsvc
             /// <returns></returns>
             public static bool Verify(string FileName, out List<Signer> Signers)
             {
-                WinVerifyTrustResult result = VerifyEmbeddedSignature(FileName, out Signers);
+                return Verify(FileName, null, out Signers);
+            }
+
+            /// <summary>
+            /// Checks if a file can be verified by it's code signature, using hashes we've already computed for the catalog lookups
+            /// </summary>
+            /// <param name="FileName"></param>
+            /// <param name="Hashes">From Helpers.ComputeFileHashes, or null</param>
+            /// <param name="Signers"></param>
+            /// <returns></returns>
+            public static bool Verify(string FileName, FileHashes Hashes, out List<Signer> Signers)
+            {
+                // Check embedded signatures ourselves where we can, as it's much cheaper than WinVerifyTrust
+                WinVerifyTrustResult result;
+                WinVerifyTrustResult? managedResult = AuthenticodeVerifier.Verify(FileName, Hashes, out Signers);
+                if (managedResult.HasValue)
+                {
+                    result = managedResult.Value;
+                }
+                else
+                {
+                    result = VerifyEmbeddedSignature(FileName, out Signers);
+                }
                 if (result == WinVerifyTrustResult.FileNotSigned)
                 {
                     // File may have been signed in a catalog, so check those.
                     // First look for a SHA256 signature
-                    result = VerifyFileFromCatalog(FileName, "SHA256", out Signers);
+                    result = VerifyFileFromCatalog(FileName, "SHA256", Hashes, out Signers);
                     if (result != WinVerifyTrustResult.Success)
                     {
                         // No SHA256 found, so look for whatever we can
-                        result = VerifyFileFromCatalog(FileName, null, out Signers);
+                        result = VerifyFileFromCatalog(FileName, null, Hashes, out Signers);
                     }
                 }
 
@@ -9,6 +9,7 @@
 
 using System;
 using System.Collections.Generic;
+using System.Linq;
 using System.Text;
 using System.Threading;
 using System.Reflection;
@@ -17,6 +18,7 @@ using System.Runtime.InteropServices;
 using System.Text.RegularExpressions;
 using System.Management;
 using System.Diagnostics;
+using System.Threading.Tasks;
 
 namespace srsvc
 {
@@ -27,6 +29,7 @@ namespace srsvc
     {
         static Thread beaconThread = null;
         static Beacon beacon = null;
+        static CommandChannel commandChannel = null;
 
         public static bool bRunning = true;
 
@@ -34,12 +37,27 @@ namespace srsvc
         {
             bRunning = false;
             QdUnInitialize();
+            CatalogIndex.Stop();
+            PreScanner.Stop();
+
+            // Not waited on, as it may be in the middle of a long poll that only the server ends
+            if (commandChannel != null)
+            {
+                commandChannel.Stop();
+            }
 
             if (beaconThread != null)
             {
                 beacon.Stop();
                 while (beaconThread.IsAlive);
             }
+            CommandExecutor.Stop();
+
+            // Waits for telemetry to stop reading the event journals before they're closed below
+            BeaconScheduler.Stop();
+
+            // Last, so events from anything above still get written
+            EventWriter.Stop();
         }
 
         public static SystemConfig conf;
@@ -51,6 +69,7 @@ namespace srsvc
 
             public string ImageFileName;
             public string CommandLine;
+            public DateTime StartTime;  // UTC
 
             public PROCESS_INFO(COMM_CREATE_PROC comm_Create_Proc)
             {
@@ -58,23 +77,18 @@ namespace srsvc
                 ppid = comm_Create_Proc.ppid;
                 CommandLine = new string(comm_Create_Proc.CommandLineBuf, 0, comm_Create_Proc.CommandLineLength / 2);
                 ImageFileName = new string(comm_Create_Proc.ImageFileNameBuf, 0, comm_Create_Proc.ImageFileNameLength / 2);
+                StartTime = DateTime.UtcNow;
             }
 
-            public PROCESS_INFO(Process process)
+            public PROCESS_INFO(ManagementBaseObject win32Process)
             {
-                pid = (UInt32)process.Id;
-                ppid = 0;
-                CommandLine = "";
-                ImageFileName = process.MainModule.FileName;
-
-                string query = String.Format("SELECT CommandLine, ParentProcessId FROM Win32_Process WHERE ProcessId = {0}", pid);
-                ManagementObjectSearcher searcher = new ManagementObjectSearcher(query);
-                foreach (ManagementObject proc in searcher.Get())
-                {
-                    ppid = (UInt32)proc["ParentProcessId"];
-                    CommandLine = (string)proc["CommandLine"].ToString();
-                    break;
-                }
+                pid = (UInt32)win32Process["ProcessId"];
+                ppid = (UInt32)win32Process["ParentProcessId"];
+                CommandLine = (string)win32Process["CommandLine"] ?? "";
+                ImageFileName = (string)win32Process["ExecutablePath"];
+
+                string creationDate = (string)win32Process["CreationDate"];
+                StartTime = (creationDate != null) ? ManagementDateTimeConverter.ToDateTime(creationDate).ToUniversalTime() : DateTime.MinValue;
             }
         }
 
@@ -177,11 +191,12 @@ namespace srsvc
                 Log.Info("New process: {0}", imageFileName);
                 Log.Info("  Cmd line: {0}", new string(createProc.CommandLineBuf));
 
-                long ExecutableId;
-
-                Decision decision = Arbiter.DecideOnProcess(imageFileName, out ExecutableId);
                 PROCESS_INFO processInfo = new PROCESS_INFO(createProc);
-                Database.LogProcessEvent(processInfo, ExecutableId, Database.ProcessState.Started);
+                var process = ProcessTree.Add(processInfo.pid, processInfo.ppid, Arbiter.TryCleanPath(imageFileName), processInfo.StartTime);
+
+                // The process event is logged once the executable has been recorded, after we've answered the driver
+                Decision decision = Arbiter.DecideOnProcess(imageFileName, process, Arbiter.DECISION_BUDGET,
+                    (ExecutableId, finalDecision) => Database.LogProcessEvent(processInfo, ExecutableId, Database.ProcessState.Started, finalDecision));
 
                 CommunicateProcessDecision(decision, ref createProc, imageFileName);
             }
@@ -215,46 +230,71 @@ namespace srsvc
         }
 
 
+        /// <summary>
+        /// Lists the running processes with one WMI query.  Returns an empty list if that fails.
+        /// </summary>
+        /// <returns></returns>
+        public static List<PROCESS_INFO> ListRunningProcesses()
+        {
+            var processes = new List<PROCESS_INFO>();
+            try
+            {
+                var searcher = new ManagementObjectSearcher("SELECT ProcessId, ParentProcessId, CommandLine, ExecutablePath, CreationDate FROM Win32_Process");
+                foreach (ManagementBaseObject proc in searcher.Get())
+                {
+                    processes.Add(new PROCESS_INFO(proc));
+                }
+            }
+            catch (Exception e)
+            {
+                Log.Exception(e, "Exception listing running processes");
+                processes.Clear();
+            }
+            return processes;
+        }
+
+
         /// <summary>
         /// Run when this service is first started.  Most useful for at install, or anything that starts before us on boot.
         /// Check the currently executing processes and records info about them and also checks them against our rules to note 
         /// anything that should not have been running already (TODO Need to alert about that)
+        ///
+        /// The processes are listed with one WMI query (see ListRunningProcesses), and then analyzed in parallel.
         /// </summary>
-        public void AnalyzeRunningProcesses()
+        /// <param name="running"></param>
+        public void AnalyzeRunningProcesses(List<PROCESS_INFO> running)
         {
-            foreach(Process process in Process.GetProcesses()) {
+            var stopwatch = Stopwatch.StartNew();
+
+            // "System" (4) and "idle" (0) processes don't have an image file, and protected processes won't give us theirs,
+            // so ignore them
+            var processes = running.Where(p => !String.IsNullOrEmpty(p.ImageFileName)).ToList();
+
+            // Copies of the same executable share one decision, see Arbiter
+            var options = new ParallelOptions { MaxDegreeOfParallelism = Environment.ProcessorCount };
+            Parallel.ForEach(processes, options, processInfo =>
+            {
                 try
                 {
-                    Log.Info("Process: {0} ID: {1}", process.ProcessName, process.Id);
-                    string fileName = process.Modules[0].FileName;
-                    Log.Info("File name: {0}", fileName);
+                    Log.Info("Process: {0} ID: {1}", processInfo.ImageFileName, processInfo.pid);
                     long ExecutableId;
-                    if (Arbiter.DecideOnProcess(fileName, out ExecutableId) == Decision.DENY)
+                    Decision decision = Arbiter.DecideOnProcess(processInfo.ImageFileName, ProcessTree.Get(processInfo.pid), out ExecutableId);
+                    if (decision == Decision.DENY)
                     {
-                        Log.Warn("*** This file should not be running: {0}", fileName);
+                        Log.Warn("*** This file should not be running: {0}", processInfo.ImageFileName);
                         // File running that should not be.
                         // TODO Alert and/or Kill this process
                     }
 
-                    PROCESS_INFO processInfo = new PROCESS_INFO(process);
-                    Database.LogProcessEvent(processInfo, ExecutableId, Database.ProcessState.Exists);
-
-                } catch (Exception e) {
-                    if (process.Id == 0 || process.Id == 4)
-                    {
-                        // "System" (4) and "idle" (0) processes cannot have their modules enumerated,
-                        // so ignore them
-                    }
-                    else if (process.HasExited)
-                    {
-                        // no-op, just an exception because the process already exited
-                    }
-                    else
-                    {
-                        Log.Exception(e, "Exception reading process: {0}", process.ProcessName);
-                    }       
+                    Database.LogProcessEvent(processInfo, ExecutableId, Database.ProcessState.Exists, decision);
                 }
-            }
+                catch (Exception e)
+                {
+                    Log.Exception(e, "Exception reading process: {0}", processInfo.ImageFileName);
+                }
+            });
+
+            Log.Info("Analyzed {0} running processes in {1}ms", processes.Count, stopwatch.ElapsedMilliseconds);
         }
 
         public void Run()
@@ -264,15 +304,43 @@ namespace srsvc
             {
                 conf = new SystemConfig();
                 MessagingInterfaces.UIComm.Init(); // Init static class
-                AnalyzeRunningProcesses();
+
+                // Process events are queued and written in batches from here on
+                EventWriter.Start();
+
+                // Load the catalog index and bring it up to date in the background.  Until it is current, catalog lookups fall back to Windows.
+                CatalogIndex.Start();
+
                 processMonitorCallback = new processMonitorCallbackDelegate(ProcessMonitorCallback);
 
-                // Start thread that communites with our server
+                // Start the workers for telemetry and the server's commands, then the thread that communites with our server
+                BeaconScheduler.Start();
+                CommandExecutor.Start();
                 beacon = new Beacon();
                 beaconThread = new Thread(new ThreadStart(beacon.Run));
                 beaconThread.Name = "BeaconThread";
                 beaconThread.IsBackground = true;
                 beaconThread.Start();
+
+                // Start thread that gets commands from our server as soon as it has them
+                commandChannel = new CommandChannel();
+                var commandChannelThread = new Thread(new ThreadStart(commandChannel.Run));
+                commandChannelThread.Name = "CommandChannelThread";
+                commandChannelThread.IsBackground = true;
+                commandChannelThread.Start();
+
+                // Decide on executables before they're run, at low priority
+                PreScanner.Start();
+
+                // Put what's already running in the process tree before we hear about new processes, so their parents are in it
+                var running = ListRunningProcesses();
+                ProcessTree.AddRunning(running);
+
+                // Check what was already running while we start enforcing on new processes
+                var startupThread = new Thread(() => AnalyzeRunningProcesses(running));
+                startupThread.Name = "AnalyzeRunningProcessesThread";
+                startupThread.IsBackground = true;
+                startupThread.Start();
                 
                 while (QdMonitor(processMonitorCallback))
                 {